@@ -0,0 +1,61 @@
+// Host-side cost per runtime call.
+// Built against prl_opencl and prl_opencl_fast; comparing both shows the overhead of the profiling hooks.
+
+#include <prl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const char *source = "__kernel void noop(__global int *a, int n) { }";
+
+static double now() {
+    struct timespec stamp;
+    clock_gettime(CLOCK_MONOTONIC, &stamp);
+    return stamp.tv_sec + stamp.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    int calls = (argc > 1) ? atoi(argv[1]) : 100000;
+    static int data[1024];
+    static prl_scop scop;
+    static prl_program program;
+    static prl_kernel kernel;
+
+    prl_init();
+
+    // Warm up: build the program and create the buffer
+    prl_scop_instance scopinst = prl_scop_enter(&scop);
+    prl_scop_program_from_str(scopinst, &program, source, 0, "");
+    prl_scop_init_kernel(scopinst, &kernel, program, "noop");
+    prl_scop_leave(scopinst);
+
+    scopinst = prl_scop_enter(&scop);
+    prl_mem mem = prl_scop_get_mem(scopinst, data, sizeof data, "data");
+    size_t work_size[] = { 1024 };
+    size_t block_size[] = { 64 };
+    int n = 1024;
+    struct prl_kernel_call_arg args[] = {
+        { .type = prl_kernel_call_arg_mem, .mem = mem, .access = prl_kernel_call_arg_read },
+        { .type = prl_kernel_call_arg_value, .data = &n, .size = sizeof n },
+    };
+
+    double start = now();
+    for (int i = 0; i < calls; i += 1)
+        prl_scop_call(scopinst, kernel, 1, work_size, 1, block_size, 2, args);
+    double enqueued = now();
+    prl_scop_leave(scopinst);
+    double finished = now();
+
+    double alloc_start = now();
+    for (int i = 0; i < calls; i += 1)
+        prl_free(prl_alloc(sizeof data));
+    double alloc_stop = now();
+
+    printf("prl_scop_call:       %10.1f ns/call\n", (enqueued - start) * 1e9 / calls);
+    printf("prl_scop_leave:      %10.3f ms\n", (finished - enqueued) * 1e3);
+    printf("prl_alloc+prl_free:  %10.1f ns/pair\n", (alloc_stop - alloc_start) * 1e9 / calls);
+
+    prl_release();
+    return 0;
+}
@@ -58,7 +58,8 @@ void prl_mem_free(prl_mem mem);
 /* Return a dereferencable host pointer containing the current data.
  * Do not read from it while prl_mem_host_noread flag is set.
  * Do not write to it if prl_mem_host_nowrite is set.
- * Do not even call this function at all if both flags (prl_mem_host_noaccess) are set. */
+ * Do not even call this function at all if both flags (prl_mem_host_noaccess) are set.
+ * With PRL_LAZY_READBACK, this is what reads back the buffer after a SCoP; call it again after every SCoP before the host accesses the buffer. */
 void *prl_mem_get_host_mem(prl_mem mem);
 
 void prl_mem_change_flags(prl_mem mem, enum prl_mem_flags add_flags, enum prl_mem_flags remove_flags);
@@ -1,6 +1,9 @@
 #ifndef PRL_PERF_H
 #define PRL_PERF_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -10,9 +13,70 @@ void prl_perf_start();
 void prl_perf_stop();
 void prl_perf_dump();
 
+/* Print the statistics accumulated since the previous call (or prl_init) and start a new window.
+ * Also invoked by PRL_DUMP_INTERVAL and PRL_DUMP_SIGNAL. */
+void prl_perf_dump_window();
+
 typedef void (*timing_callback)(void *user);
 void prl_perf_benchmark(timing_callback benched_func, timing_callback init_callback, timing_callback finit_callback, void *user);
 
+/* Statistics while the program runs, e.g. to export them to other monitoring.
+ * Durations are in nanoseconds and accumulated since prl_init.  CPU times require PRL_PROF_CPU, GPU times PRL_PROF_GPU; they are 0 otherwise.
+ * GPU times are extrapolated if only some SCoP instances are profiled (PRL_PROF_SAMPLE).
+ * Percentiles are the upper bound of the power-of-two bucket that contains them.
+ * Include the instances left with prl_scop_leave_async that have completed; with PRL_PROGRESS_THREAD, the progress thread's measurements are merged on the calling thread, so the values are consistent while the program runs.
+ * Must not be called concurrently with other PRL functions. */
+struct prl_perf_snapshot {
+    int64_t active; // Time since prl_init
+    int64_t cpu_scop;
+    uint64_t scop_instances;
+
+    int64_t gpu_working;
+    int64_t gpu_idle;
+    int64_t gpu_transfer_to_device;
+    int64_t gpu_transfer_to_host;
+    int64_t gpu_compute;
+
+    uint64_t commands; // Profiled commands with valid queue and submit timestamps
+    int64_t queue_latency_p50, queue_latency_p90, queue_latency_p99;
+    int64_t submit_latency_p50, submit_latency_p90, submit_latency_p99;
+
+    uint64_t bytes_to_device;
+    uint64_t bytes_to_host;
+};
+void prl_perf_get_stats(struct prl_perf_snapshot *snapshot);
+
+struct prl_perf_kernel_stats {
+    const char *name;
+    int launches; // Profiled launches
+    int64_t total_duration;
+    int64_t duration_p50, duration_p90, duration_p99;
+    int64_t queue_latency_mean;
+    int64_t submit_latency_mean;
+};
+typedef void (*prl_perf_kernel_callback)(const struct prl_perf_kernel_stats *stats, void *user);
+void prl_perf_foreach_kernel(prl_perf_kernel_callback callback, void *user);
+
+/* Accumulated since the SCoP was first entered or prl_perf_reset. */
+struct prl_perf_scop_stats {
+    const char *name; // NULL unless entered with prl_scop_enter_named
+    int instances;
+    int64_t cpu_time;
+    int64_t gpu_working;
+    int64_t gpu_idle;
+    int64_t gpu_transfer_to_device;
+    int64_t gpu_transfer_to_host;
+    int64_t gpu_compute;
+    uint64_t bytes_to_device;
+    uint64_t bytes_to_host;
+};
+typedef void (*prl_perf_scop_callback)(const struct prl_perf_scop_stats *stats, void *user);
+void prl_perf_foreach_scop(prl_perf_scop_callback callback, void *user);
+
+/* Every statistic as printed by PRL_DUMP_*: durations with unit "ns" and count of measurements, counters with their unit and count 0. */
+typedef void (*prl_perf_entry_callback)(const char *name, const char *unit, uint64_t value, int count, void *user);
+void prl_perf_foreach_entry(prl_perf_entry_callback callback, void *user);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -23,9 +23,25 @@ typedef struct prl_program_struct *prl_program;
 struct prl_kernel_struct;
 typedef struct prl_kernel_struct *prl_kernel;
 
+struct prl_scop_completion_struct;
+typedef struct prl_scop_completion_struct *prl_scop_completion;
+
+/* Called when all commands of a SCoP instance left by prl_scop_leave_async have completed.
+ * Runs on a thread of the OpenCL implementation; must not call PRL functions. */
+typedef void (*prl_scop_completion_callback)(void *user);
+
 enum prl_kernel_call_arg_type {
     prl_kernel_call_arg_mem,
-    prl_kernel_call_arg_value
+    prl_kernel_call_arg_value,
+    prl_kernel_call_arg_chunk_offset // cl_ulong index of the chunk's first item in the outermost dimension (see prl_scop_call_streamed); 0 for prl_scop_call
+};
+
+/* How a kernel accesses a prl_kernel_call_arg_mem argument. */
+enum prl_kernel_call_arg_access {
+    prl_kernel_call_arg_readwrite = 0, // default if not initialized
+    prl_kernel_call_arg_read,          // kernel does not modify the buffer
+    prl_kernel_call_arg_write,         // kernel does not read, but might not overwrite every element
+    prl_kernel_call_arg_write_discard  // kernel overwrites the entire buffer; its previous content is not needed
 };
 
 struct prl_kernel_call_arg {
@@ -37,16 +53,37 @@ struct prl_kernel_call_arg {
             size_t size;
         };
     };
+    enum prl_kernel_call_arg_access access;
+    size_t item_size; // prl_scop_call_streamed: bytes of the buffer per index of the outermost work dimension; 0 if every chunk needs the entire buffer
 };
 
 prl_scop_instance prl_scop_enter(prl_scop *scop); // fixed
+/* Like prl_scop_enter; name identifies the SCoP in the statistics, e.g. "file.c:42:function". It is copied when the SCoP is first entered. */
+prl_scop_instance prl_scop_enter_named(prl_scop *scop, const char *name);
 void prl_scop_leave(prl_scop_instance scop);      // fixed
 
+/* Like prl_scop_leave, but does not wait for the device to finish.
+ * The host must not access buffers used in the SCoP before prl_scop_wait returns or prl_scop_test returns true; PRL functions taking these buffers wait implicitly.
+ * The returned handle must be passed to prl_scop_wait or to prl_scop_test until it returns true, which also frees it.
+ * callback may be NULL. */
+prl_scop_completion prl_scop_leave_async(prl_scop_instance scop, prl_scop_completion_callback callback, void *user);
+void prl_scop_wait(prl_scop_completion completion);
+bool prl_scop_test(prl_scop_completion completion);
+
 //TODO: rename prl_scop_opencl_*
 void prl_scop_program_from_file(prl_scop_instance scop, prl_program *program, const char *filename, const char *build_options); //TODO: Independent of SCOPinstance
 void prl_scop_program_from_str(prl_scop_instance scop, prl_program *program, const char *str, size_t str_size, const char *build_options);
 void prl_scop_init_kernel(prl_scop_instance scop, prl_kernel *kernel, prl_program program, const char *kernelname);
 
+/* Declare that the kernel's results only depend on its arguments, i.e. it has no side effects and does not use anything else.
+ * A launch with the same NDRange, scalar arguments and input buffer contents as a previous launch whose outputs are still on the device is skipped and the outputs are reused (PRL_MEMO_CACHE).
+ * Only launches without prl_kernel_call_arg_readwrite buffers are remembered. */
+void prl_kernel_set_pure(prl_kernel kernel, bool pure);
+
+/* Declare that the kernel only uses get_global_id and get_local_id to determine its work item, so that PRL_LAUNCH_SLICES may split its launches using global work offsets.
+ * get_group_id would restart at 0 in every slice, and get_num_groups and get_global_size would return the slice's size, as PPCG-generated kernels use them. */
+void prl_kernel_set_sliceable(prl_kernel kernel, bool sliceable);
+
 #if __STDC__ >= 199901L
 // C99
 void prl_scop_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[static const restrict grid_dims], int block_dims, size_t block_size[static const restrict block_dims], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]);
@@ -55,13 +92,42 @@ void prl_scop_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims,
 void prl_scop_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[], int block_dims, size_t block_size[], size_t n_args, struct prl_kernel_call_arg args[]);
 #endif
 
+/* Like prl_scop_call, with get_global_id(i) starting at work_offset[i] instead of 0. work_offset may be NULL. */
+#if __STDC__ >= 199901L
+void prl_scop_call_offset(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_offset[], size_t work_size[static const restrict work_dims], int block_dims, size_t block_size[static const restrict block_dims], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]);
+#else
+void prl_scop_call_offset(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_offset[], size_t work_size[], int block_dims, size_t block_size[], size_t n_args, struct prl_kernel_call_arg args[]);
+#endif
+
+/* Like prl_scop_call, but the outermost work dimension is split into chunks that are executed one after another, so buffers do not need to fit into device memory.
+ * Every chunk's iterations must be independent of the other chunks.
+ * Buffer arguments with an item_size are streamed: each chunk only gets its part of it, starting at index 0 of the kernel's argument; get_global_id(0) also counts from the chunk's start.
+ * Use a prl_kernel_call_arg_chunk_offset argument to get the chunk's position.
+ * Uploads of the next chunk, the kernel and read-backs of the previous chunk overlap.
+ * chunk_items is the number of items of the outermost dimension per chunk (a multiple of block_size[0]), or 0 to derive it from the device's memory size.
+ * Returns after all chunks have completed.
+ * prl_scop_call does the same if a buffer is larger than CL_DEVICE_MAX_MEM_ALLOC_SIZE; its argument must have an item_size then. */
+#if __STDC__ >= 199901L
+void prl_scop_call_streamed(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[static const restrict work_dims], int block_dims, size_t block_size[static const restrict block_dims], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args], size_t chunk_items);
+#else
+void prl_scop_call_streamed(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[], int block_dims, size_t block_size[], size_t n_args, struct prl_kernel_call_arg args[], size_t chunk_items);
+#endif
+
 // Scenarios to cover:
 //   host+malloc    <-> device+allocation_per_scop
 //   host+prl_alloc <-> device+prl_alloc
 //                      device+
 prl_mem prl_scop_get_mem(prl_scop_instance scop, void *host_mem /*might be result of prl_alloc*/, size_t size, const char *name);
+
+/* Like prl_scop_get_mem, but only the rectangular box of a multi-dimensional array that is accessed in the SCoP is transferred.
+ * Dimensions are ordered from outermost to innermost (as in C); 1 <= dims <= 3.
+ * elt_size is the size of one element in bytes, pitches[i] the distance in bytes between two consecutive indices of dimension i (for i < dims-1; the innermost dimension is contiguous).
+ * box_offset and box_size are in elements.
+ * Memory managed by PRL (prl_alloc, prl_mem_*) is always transferred as a whole. */
+prl_mem prl_scop_get_mem_rect(prl_scop_instance scop, void *host_mem, size_t size, size_t elt_size, int dims, const size_t pitches[], const size_t box_offset[], const size_t box_size[], const char *name);
 //void prl_scop_mem_release(prl_mem mem);
 
+/* The transfer is done when the first kernel of the SCoP uses the buffer; it is skipped if that kernel's access is prl_kernel_call_arg_write_discard. */
 void prl_scop_host_to_device(prl_scop_instance scop, prl_mem mem);
 void prl_scop_device_to_host(prl_scop_instance scop, prl_mem mem);
 //void prl_scop_host_wait(prl_scop_instance scop, prl_mem mem);
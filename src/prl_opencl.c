@@ -19,6 +19,22 @@
 #include <string.h>
 #include <time.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define PRL_HAVE_MPROTECT
+#define PRL_HAVE_PTHREADS
+#define PRL_HAVE_SIGUSR1
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define PRL_HAVE_TSC
+#endif
+
 #ifdef __MACH__
 #include <mach/mach_time.h>
 #endif
@@ -32,10 +48,30 @@
 #endif //MAC_OS_X_VERSION_10_12
 #endif // __APPLE__
 
+// Build without statistics and tracing (prl_opencl_fast); the *_checked wrappers reduce to the call and its error check
+#ifdef PRL_NO_PROFILING
+#define PRL_PROFILING false
+#else
+#define PRL_PROFILING true
+#endif
+
 static const char *PRL_TARGET_DEVICE = "PRL_TARGET_DEVICE";
 static const char *PRL_BLOCKING = "PRL_BLOCKING";
 //static const char *PRL_PREFERRED_TRANSFER = "PRL_TRANSFER"; // Select a preferred transfer mode (clEnqueueRead/WriteBuffer, clEnqueueMapBuffer, ...)
 static const char *PRL_COMMAND_QUEUE = "PRL_COMMAND_QUEUE";
+static const char *PRL_DIRTY_TRACKING = "PRL_DIRTY_TRACKING"; // Only upload host pages that have been written to
+static const char *PRL_LAZY_READBACK = "PRL_LAZY_READBACK";   // Only read back buffers when the host requests access using prl_mem_get_host_mem
+static const char *PRL_SCOP_REPLAY = "PRL_SCOP_REPLAY";       // Record the commands of a SCoP's first instance and replay them in later ones
+static const char *PRL_PROGRESS_THREAD = "PRL_PROGRESS_THREAD"; // Retire completed events in a background thread
+static const char *PRL_DEVICE_MEMORY_BUDGET = "PRL_DEVICE_MEMORY_BUDGET"; // Evict least recently used buffers from the device above this size
+static const char *PRL_LAUNCH_SLICES = "PRL_LAUNCH_SLICES";   // Split every kernel launch into this many launches along the outermost dimension
+static const char *PRL_DEDUP_UPLOADS = "PRL_DEDUP_UPLOADS";   // Share device buffers between read-only buffers with the same content
+static const char *PRL_MEMO_CACHE = "PRL_MEMO_CACHE";         // Number of remembered launches of pure kernels
+static const char *PRL_CLOCK = "PRL_CLOCK";                   // Timestamp source: tsc, monotonic or monotonic_raw
+static const char *PRL_ADVISE = "PRL_ADVISE";                 // Print recommendations at the end of the program
+static const char *PRL_PROF_SAMPLE = "PRL_PROF_SAMPLE";       // Profile the GPU only in every N-th SCoP instance, or a random fraction of them
+static const char *PRL_DUMP_INTERVAL = "PRL_DUMP_INTERVAL";   // Print the statistics of the last interval every this many seconds
+static const char *PRL_DUMP_SIGNAL = "PRL_DUMP_SIGNAL";       // Print the statistics since the previous dump when receiving SIGUSR1
 
 static const char *PRL_PREFIX = "PRL_PREFIX";
 
@@ -80,6 +116,12 @@ enum prl_device_choice {
     PRL_TARGET_DEVICE_ACC_THEN_GPU_THEN_CPU,
 };
 
+enum prl_clock {
+    prl_clock_monotonic_raw, // clock_gettime(CLOCK_MONOTONIC_RAW)
+    prl_clock_monotonic,     // clock_gettime(CLOCK_MONOTONIC)
+    prl_clock_tsc,           // Invariant time stamp counter, calibrated at prl_init
+};
+
 struct prl_global_config {
     enum prl_device_choice device_choice;
     int chosen_platform;
@@ -87,6 +129,15 @@ struct prl_global_config {
 
     bool blocking;
 	bool global_command_queue;
+    bool dirty_tracking;
+    bool lazy_readback;
+    bool scop_replay;
+    bool progress_thread;
+    cl_ulong device_memory_budget; // 0 for unlimited
+    int launch_slices;             // 0 or 1 to not split launches
+    bool dedup_uploads;
+    int memo_cache;                // 0 to disable memoization of pure kernels
+    enum prl_clock clock;
 
     const char *bench_prefix;
     bool cpu_profiling;
@@ -95,6 +146,11 @@ struct prl_global_config {
     bool cpu_detailed_profiling;
     bool dump_on_release;
     const char *profiling_prefix;
+    int prof_sample;             // Profile every prof_sample-th SCoP instance; 0 or 1 for all
+    bool advise;
+    double prof_sample_fraction; // Random fraction of SCoP instances to profile; 0 to use prof_sample
+    double dump_interval;        // Seconds between periodic dumps; 0 to disable
+    bool dump_signal;
 
     int timing_runs;
     int timing_warmups;
@@ -114,12 +170,15 @@ static struct prl_global_config global_config = {
 
   .timing_runs = 10,
   .timing_warmups = 1,
+
+  .memo_cache = 16,
 };
 
 enum prl_stat_entry {
     stat_cpu_global, // CPU time since prl_init()
     stat_cpu_bench,  // CPU time between prl_perf_start() and prl_perf_stop()
     stat_cpu_scop,   // CPU time spent in scops
+    stat_cpu_content_hash, // Hashing buffers for PRL_DEDUP_UPLOADS and PRL_MEMO_CACHE
 
     // system calls
     stat_cpu_malloc,
@@ -132,11 +191,18 @@ enum prl_stat_entry {
     stat_cpu_clCreateCommandQueue,
     stat_cpu_clGetDeviceIDs,
     stat_cpu_clReleaseMemObject,
+    stat_cpu_clRetainMemObject,
+    stat_cpu_clEnqueueCopyBuffer,
     stat_cpu_clEnqueueWriteBuffer,
     stat_cpu_clEnqueueReadBuffer,
+    stat_cpu_clEnqueueWriteBufferRect,
+    stat_cpu_clEnqueueReadBufferRect,
     stat_cpu_clEnqueueNDRangeKernel,
     stat_cpu_clEnqueueMapBuffer,
     stat_cpu_clFinish,
+    stat_cpu_clFlush,
+    stat_cpu_clEnqueueMarker,
+    stat_cpu_clSetEventCallback,
     stat_cpu_clReleaseCommandQueue,
 	stat_cpu_clReleaseContext,
     stat_cpu_clCreateBuffer,
@@ -153,6 +219,7 @@ enum prl_stat_entry {
     stat_cpu_clGetMemObjectInfo,
     stat_cpu_clCreateProgramWithSource,
     stat_cpu_clGetProgramBuildInfo,
+    stat_cpu_clGetKernelWorkGroupInfo,
     stat_cpu_clBuildProgram,
 
     // OpenCL profiling
@@ -165,6 +232,9 @@ enum prl_stat_entry {
     stat_gpu_transfer_to_host,
     stat_gpu_compute,
 
+    stat_gpu_queue_latency,  // From CL_PROFILING_COMMAND_QUEUED to CL_PROFILING_COMMAND_SUBMIT
+    stat_gpu_submit_latency, // From CL_PROFILING_COMMAND_SUBMIT to CL_PROFILING_COMMAND_START
+
     stat_gpu_NDRANGE_KERNEL,
     stat_gpu_TASK,
     stat_gpu_NATIVE_KERNEL,
@@ -197,6 +267,7 @@ enum prl_stat_entry {
 #define STAT_CPU_LAST stat_cpu_clBuildProgram
 #define STAT_GPU_FIRST stat_gpu_total
 #define STAT_GPU_LAST stat_gpu_other
+#define STAT_GPU_COMMANDS (STAT_GPU_LAST - stat_gpu_NDRANGE_KERNEL + 1)
 
 static enum prl_stat_entry clcommand_to_stat_entry(cl_int command) {
     switch (command) {
@@ -259,6 +330,7 @@ static enum prl_stat_entry clcommand_to_stat_entry(cl_int command) {
 
 static const char *statname[] = {
     [stat_cpu_scop] = "time in SCoPs",
+    [stat_cpu_content_hash] = "content hashing",
 
     [stat_cpu_malloc] = "malloc",
     [stat_cpu_realloc] = "realloc",
@@ -269,11 +341,18 @@ static const char *statname[] = {
     [stat_cpu_clCreateCommandQueue] = "clCreateCommandQueue",
     [stat_cpu_clGetDeviceIDs] = "clGetDeviceIDs",
     [stat_cpu_clReleaseMemObject] = "clReleaseMemObject",
+    [stat_cpu_clRetainMemObject] = "clRetainMemObject",
+    [stat_cpu_clEnqueueCopyBuffer] = "clEnqueueCopyBuffer",
     [stat_cpu_clEnqueueWriteBuffer] = "clEnqueueWriteBuffer",
     [stat_cpu_clEnqueueReadBuffer] = "clEnqueueReadBuffer",
+    [stat_cpu_clEnqueueWriteBufferRect] = "clEnqueueWriteBufferRect",
+    [stat_cpu_clEnqueueReadBufferRect] = "clEnqueueReadBufferRect",
     [stat_cpu_clEnqueueNDRangeKernel] = "clEnqueueNDRangeKernel",
     [stat_cpu_clEnqueueMapBuffer] = "clEnqueueMapBuffer",
     [stat_cpu_clFinish] = "clFinish",
+    [stat_cpu_clFlush] = "clFlush",
+    [stat_cpu_clEnqueueMarker] = "clEnqueueMarker",
+    [stat_cpu_clSetEventCallback] = "clSetEventCallback",
     [stat_cpu_clReleaseCommandQueue] = "clReleaseCommandQueue",
 	[stat_cpu_clReleaseContext] = "clReleaseContext",
     [stat_cpu_clCreateBuffer] = "clCreateBuffer",
@@ -290,6 +369,7 @@ static const char *statname[] = {
     [stat_cpu_clGetMemObjectInfo] = "clGetMemObjectInfo",
     [stat_cpu_clCreateProgramWithSource] = "clCreateProgramWithSource",
     [stat_cpu_clGetProgramBuildInfo] = "clGetProgramBuildInfo",
+    [stat_cpu_clGetKernelWorkGroupInfo] = "clGetKernelWorkGroupInfo",
     [stat_cpu_clBuildProgram] = "clBuildProgram",
 
                                   [stat_gpu_total] = "total",
@@ -300,6 +380,9 @@ static const char *statname[] = {
     [stat_gpu_transfer_to_host] = "dev->host",
     [stat_gpu_compute] = "compute",
 
+    [stat_gpu_queue_latency] = "queued->submit",
+    [stat_gpu_submit_latency] = "submit->start",
+
     [stat_gpu_NDRANGE_KERNEL] = "CL_COMMAND_NDRANGE_KERNEL",
     [stat_gpu_TASK] = "CL_COMMAND_TASK",
     [stat_gpu_NATIVE_KERNEL] = "CL_COMMAND_NATIVE_KERNEL",
@@ -331,9 +414,74 @@ static const char *statname[] = {
 typedef prl_time_t prl_stat_list[STAT_ENTRIES];
 typedef int prl_count_list[STAT_ENTRIES];
 
+// Quantities that are not durations
+enum prl_counter_entry {
+    counter_bytes_to_device,
+    counter_bytes_to_host,
+    counter_bytes_dirty_skipped, // Not uploaded because the host pages have not been written to
+    counter_host_write_faults,   // Page faults to record dirty pages
+    counter_bytes_deferred,      // Read-backs deferred to the host's first access
+    counter_lazy_readbacks,      // Deferred read-backs that actually were needed
+    counter_bytes_discard_skipped, // Not uploaded because the first kernel overwrites the buffer
+    counter_replayed_cmds,         // SCoP commands that matched the recording (PRL_SCOP_REPLAY)
+    counter_replay_divergences,    // SCoP instances that did not match the recording
+    counter_setarg_skipped,        // clSetKernelArg calls not needed because the argument was already set
+    counter_streamed_chunks,       // Kernel launches of prl_scop_call_streamed
+    counter_evictions,             // Device buffers released to stay within PRL_DEVICE_MEMORY_BUDGET
+    counter_bytes_evicted,
+    counter_bytes_hashed,          // PRL_DEDUP_UPLOADS, PRL_MEMO_CACHE
+    counter_bytes_dedup_skipped,   // Not uploaded because a device buffer with the same content existed
+    counter_memo_hits,             // Launches of pure kernels whose results were reused
+    counter_memo_misses,
+};
+#define COUNTER_ENTRIES (counter_memo_misses + 1)
+
+static const char *countername[] = {
+    [counter_bytes_to_device] = "host->dev",
+    [counter_bytes_to_host] = "dev->host",
+    [counter_bytes_dirty_skipped] = "skipped (clean pages)",
+    [counter_host_write_faults] = "host write faults",
+    [counter_bytes_deferred] = "deferred dev->host",
+    [counter_lazy_readbacks] = "lazy read-backs",
+    [counter_bytes_discard_skipped] = "skipped (overwritten)",
+    [counter_replayed_cmds] = "replayed commands",
+    [counter_replay_divergences] = "replay divergences",
+    [counter_setarg_skipped] = "clSetKernelArg skipped",
+    [counter_streamed_chunks] = "streamed chunks",
+    [counter_evictions] = "evictions",
+    [counter_bytes_evicted] = "evicted",
+    [counter_bytes_hashed] = "content hashed",
+    [counter_bytes_dedup_skipped] = "dedup skipped",
+    [counter_memo_hits] = "memoized launches",
+    [counter_memo_misses] = "memo misses",
+};
+
+static const char *counterunit[] = {
+    [counter_bytes_to_device] = "bytes",
+    [counter_bytes_to_host] = "bytes",
+    [counter_bytes_dirty_skipped] = "bytes",
+    [counter_host_write_faults] = "",
+    [counter_bytes_deferred] = "bytes",
+    [counter_lazy_readbacks] = "",
+    [counter_bytes_discard_skipped] = "bytes",
+    [counter_replayed_cmds] = "",
+    [counter_replay_divergences] = "",
+    [counter_setarg_skipped] = "",
+    [counter_streamed_chunks] = "",
+    [counter_evictions] = "",
+    [counter_bytes_evicted] = "bytes",
+    [counter_bytes_hashed] = "bytes",
+    [counter_bytes_dedup_skipped] = "bytes",
+    [counter_memo_hits] = "",
+    [counter_memo_misses] = "",
+};
+
+typedef uint64_t prl_counter_list[COUNTER_ENTRIES];
+
 struct prl_stat {
     prl_stat_list entries;
     prl_count_list counts;
+    prl_counter_list counters;
 };
 
 static int cmp_time(const void *lhs_arg, const void *rhs_arg) {
@@ -346,6 +494,74 @@ static double sqrd(double val) {
     return val * val;
 }
 
+// Device buffers per streamed argument of prl_scop_call_streamed; uploading, computing and reading back can overlap for this many chunks
+#define STREAM_SLOTS 3
+
+// A device buffer with known content (PRL_DEDUP_UPLOADS)
+struct prl_dedup_entry {
+    uint64_t hash[2];
+    size_t size;
+    cl_mem clmem; // Reference held by the cache; NULL if unused; counted in dev_resident_bytes
+    uint64_t last_use;
+    int users;    // Mems using clmem (dev_shared); only entries without users can be replaced or evicted
+    cl_event ready;         // Completion of the upload; NULL if known to have completed
+    cl_command_queue queue; // Queue of the upload; commands on other queues have to wait for ready
+};
+#define DEDUP_CACHE_ENTRIES 64
+
+#define LATENCY_BUCKETS 32
+
+// Launch latencies of profiled commands; bucket i counts latencies of [2^i,2^(i+1)) ns, the last one everything above
+struct prl_latency_hist {
+    uint64_t count;
+    prl_time_t queue_total;
+    prl_time_t submit_total;
+    uint64_t queue[LATENCY_BUCKETS];  // CL_PROFILING_COMMAND_QUEUED to CL_PROFILING_COMMAND_SUBMIT
+    uint64_t submit[LATENCY_BUCKETS]; // CL_PROFILING_COMMAND_SUBMIT to CL_PROFILING_COMMAND_START
+};
+
+enum transfer_dir {
+    dir_to_device,
+    dir_to_host,
+};
+
+// Transfers of all prl_mems with the same name
+struct prl_buffer_stat {
+    char *name;
+    uint64_t bytes[2]; // Indexed by enum transfer_dir
+    uint64_t transfers[2];
+    prl_time_t duration[2]; // GPU time of the transfers; only with PRL_PROF_GPU
+    bool any_transfer;
+    enum transfer_dir last_dir;
+    uint64_t last_instance;     // SCoP instance of the last transfer
+    uint64_t roundtrips_inside; // dev->host followed by host->dev in the same SCoP instance
+    uint64_t roundtrips_across; // ... in a later SCoP instance
+
+    // PRL_ADVISE
+    bool any_upload;
+    uint64_t upload_hash[2];    // Content of the last complete upload
+    uint64_t unchanged_uploads; // Same content as the previous upload
+    uint64_t unchanged_bytes;
+};
+
+// A program build, to detect the same source being built repeatedly (PRL_ADVISE)
+struct prl_build_record {
+    uint64_t hash[2]; // Source and build options
+    int builds;
+    prl_time_t duration; // Of all but the first build
+};
+
+// A launch of a pure kernel whose results are still on the device (PRL_MEMO_CACHE)
+struct prl_memo_entry {
+    bool valid;
+    uint64_t key[2]; // Fingerprint of kernel, NDRange, scalar arguments and inputs
+    size_t n_outputs;
+    size_t *output_args; // Argument index of every output
+    prl_mem *outputs;
+    uint64_t *output_versions; // dev_version of the outputs after the launch
+    uint64_t last_use;
+};
+
 struct prl_global_state {
     prl_time_t prl_start;
     struct prl_global_config config;
@@ -354,6 +570,10 @@ struct prl_global_state {
     cl_device_id device;
     cl_context context;
 	cl_command_queue queue;
+    cl_command_queue stream_queues[STREAM_SLOTS]; // One in-order queue per slot; created on first use
+
+    cl_ulong dev_global_mem_size; // CL_DEVICE_GLOBAL_MEM_SIZE
+    cl_ulong dev_max_alloc_size;  // CL_DEVICE_MAX_MEM_ALLOC_SIZE
 
     // Profiling
     struct prl_stat global_stat;
@@ -362,6 +582,12 @@ struct prl_global_state {
     // Benchmarking
     struct prl_stat prev_global_stat;
     prl_time_t bench_start;
+
+    // Statistics at the previous prl_perf_dump_window
+    struct prl_stat window_stat;
+    prl_time_t window_start;
+    uint64_t window_sample_instances;
+    uint64_t window_sample_profiled;
     size_t bench_stats_size;
     struct prl_stat *bench_stats;
 
@@ -372,10 +598,150 @@ struct prl_global_state {
     // doubly linked list (prl_mem->global_mem_next, prl_mem->global_mem_prev)
     // Needed to look up
     prl_mem global_mems;
+    uint64_t global_mems_gen; // Incremented whenever the result of prl_mem_lookup_global_ptr might change
+    uint64_t clmem_release_gen; // Incremented on every clReleaseMemObject; a released cl_mem's handle might be reused
+
+    // SCoP instances left by prl_scop_leave_async that have not been finalized yet
+    prl_scop_completion completions;
+
+#ifdef PRL_HAVE_PTHREADS
+    // Progress thread (PRL_PROGRESS_THREAD)
+    pthread_t progress_thread;
+    pthread_mutex_t progress_mutex;
+    pthread_cond_t progress_queued;  // An event completed or the thread has to stop
+    pthread_cond_t progress_retired; // An event has been retired
+    struct prl_progress_event *progress_first; // Completed events not retired yet, in completion order
+    struct prl_progress_event *progress_last;
+    bool progress_stop;
+#endif
+
+    size_t page_size;
+
+    // Device buffers of global mems, most recently used first (prl_mem->lru_next, prl_mem->lru_prev)
+    prl_mem lru_first;
+    prl_mem lru_last;
+    cl_ulong dev_resident_bytes;
+
+    struct prl_dedup_entry dedup_cache[DEDUP_CACHE_ENTRIES];
+    uint64_t dedup_clock;
+
+    uint64_t dev_version_clock; // Last value assigned to a prl_mem->dev_version
+
+    size_t memo_size;
+    struct prl_memo_entry *memo;
+    uint64_t memo_clock;
+
+    struct prl_latency_hist latency[STAT_ENTRIES]; // Indexed by command type (stat_gpu_NDRANGE_KERNEL etc.)
+
+    size_t builds_size;
+    struct prl_build_record *builds;
+
+    size_t buffer_stats_size;
+    struct prl_buffer_stat **buffer_stats; // Entries are not moved; prl_mem keeps pointers to them
+
+    uint64_t sample_instances; // SCoP instances entered
+    uint64_t sample_profiled;  // ... of which were profiled
+    uint64_t sample_random;
+
+    enum prl_clock clock; // config.clock, unless not available
+    double tsc_ns_per_tick;
+    uint64_t tsc_base;
+    prl_time_t tsc_base_ns;
+    double timestamp_cost; // Measured nanoseconds per timestamp_force()
+};
+
+enum prl_scop_cmd_type {
+    scop_cmd_get_mem,
+    scop_cmd_host_to_device,
+    scop_cmd_device_to_host,
+    scop_cmd_call,
+};
+
+#define NO_CMD ((size_t)-1)
+
+// Reference to the mem of a previous scop_cmd_get_mem, or a global mem passed without prl_scop_get_mem
+struct prl_scop_cmd_memref {
+    size_t mem_cmd;
+    prl_mem gmem;
+};
+
+struct prl_scop_cmd_arg {
+    enum prl_kernel_call_arg_type type;
+    struct prl_scop_cmd_memref mem; // prl_kernel_call_arg_mem
+    size_t size;                    // prl_kernel_call_arg_value
+
+    // Argument set by the latest instance
+    void *data;   // prl_kernel_call_arg_value; NULL for __local memory
+    cl_mem clmem; // prl_kernel_call_arg_mem
+};
+
+// A call of the prl_scop_* API, recorded for replay (PRL_SCOP_REPLAY)
+struct prl_scop_cmd {
+    enum prl_scop_cmd_type type;
+
+    // scop_cmd_get_mem
+    void *host_mem;
+    size_t size;
+    prl_mem gmem;        // Result of the global lookup; NULL if a local mem was created
+    bool registered;     // gmem was added to the instance's mems by this call
+    uint64_t global_gen; // global_state.global_mems_gen at the time of the lookup
+    cl_mem clmem;        // Device buffer of the local mem; kept from one instance to the next
+    prl_mem mem;         // Mem returned in the current instance
+
+    // scop_cmd_host_to_device, scop_cmd_device_to_host
+    struct prl_scop_cmd_memref memref;
+
+    // scop_cmd_call
+    prl_kernel kernel;
+    int work_dims;
+    size_t work_size[3];
+    int block_dims;
+    size_t block_size[3];
+    size_t n_args;
+    struct prl_scop_cmd_arg *args;
+    bool args_set;             // The kernel's arguments have been set to those in args
+    uint64_t args_gen;         // kernel->args_gen at that time; if it changed, some other call has set arguments in-between
+    uint64_t args_release_gen; // global_state.clmem_release_gen at that time
+};
+
+enum prl_replay_mode {
+    replay_off,
+    replay_recording,
+    replay_replaying,
+};
+
+struct prl_scop_completion_struct {
+    prl_scop_instance scopinst; // NULL after the instance has been finalized
+    cl_event marker;            // Completes after all commands of the instance
+    prl_scop_completion next;
+};
+
+// Passed to clSetEventCallback; freed by the callback itself because it might run after the completion handle has been freed
+struct prl_completion_notify {
+    prl_scop_completion_callback callback;
+    void *user;
 };
 
 struct prl_scop_struct {
     prl_scop next;
+    prl_scop_completion inflight; // Last instance left by prl_scop_leave_async, if not finalized yet
+
+    char *name; // From prl_scop_enter_named; NULL if unnamed
+    struct prl_stat stat; // Accumulated over all released instances
+    int instances;
+    int profiled_instances; // ... of which the GPU was profiled (PRL_PROF_SAMPLE)
+    uint64_t sample_entered; // Instances entered; every SCoP is sampled on its own
+
+    // Values at the previous prl_perf_dump_window, to extrapolate the window's GPU times
+    prl_time_t window_entries[STAT_ENTRIES];
+    int window_instances;
+    int window_profiled_instances;
+
+    // Recorded command list
+    bool recorded;
+    bool rerecord; // An instance did not match the recording; record again
+    size_t cmds_size;
+    struct prl_scop_cmd *cmds;
 };
 
 enum pending_event_type {
@@ -394,6 +760,45 @@ struct prl_pending_event {
     };
 };
 
+// An event handed to the progress thread
+struct prl_progress_event {
+    struct prl_pending_event pendev;
+    prl_scop_instance scopinst;
+    size_t slot; // Index into the instance's progress_kernels or progress_transfers; SIZE_MAX if not accumulated
+    struct prl_progress_event *next;
+};
+
+// What the progress thread accumulated for a kernel of an instance; added to the kernel on the main thread (progress_wait)
+struct prl_progress_kernel {
+    prl_kernel kernel;
+    prl_time_t total_duration;
+    int total_count;
+    uint64_t duration_hist[LATENCY_BUCKETS];
+    struct prl_latency_hist latency;
+};
+
+// What the progress thread accumulated for transfers of a buffer_stat of an instance
+struct prl_progress_transfer {
+    struct prl_buffer_stat *buffer_stat;
+    prl_time_t duration[2]; // Indexed by enum transfer_dir
+};
+
+enum prof_kind {
+    prof_all,
+    prof_to_device,
+    prof_compute,
+    prof_to_host
+};
+#define PROF_KINDS (prof_to_host + 1)
+
+// Busy and idle time of the GPU for a sequence of commands ordered by their start time
+struct gpu_durations {
+    bool started;
+    prl_time_t prev_stop;
+    prl_time_t working;
+    prl_time_t idle;
+};
+
 struct prl_scop_inst_struct {
     prl_scop scop;
     prl_time_t scop_start;
@@ -402,6 +807,19 @@ struct prl_scop_inst_struct {
     size_t event_size;
     struct prl_pending_event *pending_events;
 
+    // Events handed to the progress thread and what it has accumulated from them; protected by global_state.progress_mutex
+    size_t progress_inflight;
+    struct prl_stat progress_stat;
+    struct gpu_durations progress_durations[PROF_KINDS];
+    struct prl_latency_hist *progress_latency; // STAT_GPU_COMMANDS entries from stat_gpu_NDRANGE_KERNEL; allocated with the first slot
+    size_t progress_kernels_size;
+    struct prl_progress_kernel *progress_kernels;
+    size_t progress_transfers_size;
+    struct prl_progress_transfer *progress_transfers;
+
+    bool profiled; // Selected by PRL_PROF_SAMPLE; commands of other instances are not profiled
+    uint64_t serial; // Number of SCoP instances entered before, plus one
+
     struct prl_stat stat;
 
     prl_mem local_mems; //linked list
@@ -409,6 +827,11 @@ struct prl_scop_inst_struct {
     // global mems that are accessed in this scopinstance
     size_t mems_size;
     prl_mem *mems;
+    size_t pinned_size;
+    prl_mem *pinned; // Global mems used as kernel arguments without being registered; only kept from eviction
+
+    enum prl_replay_mode replay;
+    size_t replay_pos; // Next command of scop->cmds to match
 };
 
 struct prl_program_struct {
@@ -420,15 +843,36 @@ struct prl_program_struct {
     prl_program next;
 };
 
+// Last value passed to clSetKernelArg for an argument index
+struct prl_kernel_arg_cache {
+    bool valid;
+    size_t size;
+    void *data;
+    uint64_t clmem_release_gen; // For cl_mem arguments: global_state.clmem_release_gen when set
+};
+
 struct prl_kernel_struct {
     prl_scop scop;
     prl_program program;
     char *name;
 
     cl_kernel kernel;
+    bool pure; // Result only depends on the arguments (prl_kernel_set_pure)
+    bool sliceable; // Only uses get_global_id and get_local_id, so launches can be split (prl_kernel_set_sliceable)
+    size_t args_cache_size;
+    struct prl_kernel_arg_cache *args_cache;
+    uint64_t args_gen; // Incremented on every clSetKernelArg
 
     prl_time_t total_duration;
-    int total_count;
+    int total_count; // Profiled launches
+    int launches;    // All launches, also of unprofiled SCoP instances (PRL_PROF_SAMPLE)
+    struct prl_latency_hist latency;
+    uint64_t duration_hist[LATENCY_BUCKETS]; // Execution times, bucketed like latencies
+
+    // PRL_ADVISE
+    size_t preferred_wg_multiple; // CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE; 0 if not queried yet
+    size_t misaligned_wg_size;     // Last work-group size that is not a multiple of it
+    int misaligned_launches;
 
     prl_kernel next;
 };
@@ -469,6 +913,9 @@ enum prl_alloc_current_location {
     loc_host = loc_bit_host_is_current | loc_bit_host_writable,
     loc_dev = loc_bit_dev_is_current | loc_bit_dev_writable,
 
+    // Both buffers contain the same data (alloc_type_rwbuf only); reading on either side needs no transfer, writing drops the other side
+    loc_shared = loc_bit_host_is_current | loc_bit_dev_is_current,
+
     loc_transferring_to_host = loc_bit_transferring_dev_to_host,
     loc_transferring_to_dev = loc_bit_transferring_host_to_dev,
 
@@ -517,6 +964,38 @@ struct prl_mem_struct {
     bool transfer_to_device; // On entering a SCoP:
     bool transfer_to_host;   // On leaving a SCoP:
 
+    // prl_scop_host_to_device has been called in this SCoP; the transfer is done when the first kernel uses the buffer
+    prl_scop_instance upload_pending;
+
+    // Used by a SCoP instance left with prl_scop_leave_async that is not finalized yet
+    prl_scop_completion pending_completion;
+
+    // Residency on the device (PRL_DEVICE_MEMORY_BUDGET)
+    bool dev_resident; // clmem has been allocated by ensure_dev_allocated and is in the LRU list
+    size_t dev_resident_size; // Bytes counted in global_state.dev_resident_bytes; size might change while resident
+    bool dev_shared;   // clmem is a dedup cache buffer, possibly used by other mems as well; must not be modified
+    struct prl_buffer_stat *buffer_stat; // Shared by mems of the same name; NULL until the first transfer
+    uint64_t dev_version; // Unique among all mems; changes whenever the device buffer's content might change
+    int scop_refs;     // Number of SCoP instances using this mem; cannot be evicted while non-zero
+    prl_mem lru_prev;
+    prl_mem lru_next;
+
+    // Page-granular tracking of host writes (PRL_DIRTY_TRACKING)
+    bool host_paged;            // host_mem is page-aligned and owned by PRL, so its pages can be protected
+    bool host_protected;        // host pages are write-protected; the first write to each page is recorded in dirty_pages
+    bool host_lazy;             // host pages are access-protected; the read-back is done by prl_mem_get_host_mem (PRL_LAZY_READBACK)
+    bool dirty_baseline;        // The device buffer is equal to the host buffer, except for dirty pages
+    unsigned char *dirty_pages; // One entry per page; non-zero if written to since the last transfer
+    struct prl_fault_range *fault_range; // What the fault handler knows about the mem; non-NULL while host_protected
+
+    // Only transfer a rectangular region of the buffer (see prl_scop_get_mem_rect); in clEnqueueReadBufferRect/clEnqueueWriteBufferRect convention.
+    // The same region is used on the host and device side.
+    bool rect;
+    size_t rect_origin[3];
+    size_t rect_region[3];
+    size_t rect_row_pitch;
+    size_t rect_slice_pitch;
+
     prl_mem mem_prev, mem_next; // of prl_scop_instance->local_mems OR global_state.global_mems
 };
 
@@ -528,7 +1007,7 @@ struct prl_scopinst_mem_struct {
 static bool prl_initialized = false;
 static struct prl_global_state global_state;
 
-static prl_time_t timestamp_force() {
+static prl_time_t timestamp_clock(bool raw) {
     struct timespec stamp;
 #if defined(__MACH__) && !defined(MACH_HAS_CLOCK_GETTIME)
     static double timebase = 0.0;
@@ -542,7 +1021,7 @@ static prl_time_t timestamp_force() {
     stamp.tv_sec = atime / 1000000000L;
     stamp.tv_nsec = atime - stamp.tv_sec * 1000000000L;
 #else
-    int err = clock_gettime(CLOCK_MONOTONIC_RAW, &stamp);
+    int err = raw ? clock_gettime(CLOCK_MONOTONIC_RAW, &stamp) : -1;
         if (err)
                 err = clock_gettime(CLOCK_MONOTONIC, &stamp);
     assert(!err);
@@ -553,8 +1032,67 @@ static prl_time_t timestamp_force() {
     return result;
 }
 
+#ifdef PRL_HAVE_TSC
+static uint64_t tsc_read() {
+    unsigned int aux;
+    return __rdtscp(&aux); // Unlike rdtsc, waits for preceding instructions
+}
+
+// Ticks at a constant rate independent of frequency scaling and sleep states
+static bool tsc_invariant() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return false;
+    return edx & (1u << 8);
+}
+#endif
+
+static prl_time_t timestamp_force() {
+#ifdef PRL_HAVE_TSC
+    if (global_state.clock == prl_clock_tsc)
+        return global_state.tsc_base_ns + (prl_time_t)((int64_t)(tsc_read() - global_state.tsc_base) * global_state.tsc_ns_per_tick);
+#endif
+    return timestamp_clock(global_state.clock == prl_clock_monotonic_raw);
+}
+
+// Select the timestamp source and measure its cost
+static void clock_init() {
+    global_state.clock = global_state.config.clock;
+    if (global_state.clock == prl_clock_tsc) {
+#ifdef PRL_HAVE_TSC
+        if (tsc_invariant()) {
+            // Count ticks for 10 ms
+            prl_time_t start_ns = timestamp_clock(false);
+            uint64_t start_tsc = tsc_read();
+            prl_time_t stop_ns;
+            do {
+                stop_ns = timestamp_clock(false);
+            } while (stop_ns - start_ns < 10000000);
+            uint64_t stop_tsc = tsc_read();
+
+            global_state.tsc_ns_per_tick = (double)(stop_ns - start_ns) / (stop_tsc - start_tsc);
+            global_state.tsc_base = stop_tsc;
+            global_state.tsc_base_ns = stop_ns;
+        } else {
+            fputs("PRL_CLOCK=tsc: time stamp counter is not invariant; using monotonic\n", stderr);
+            global_state.clock = prl_clock_monotonic;
+        }
+#else
+        fputs("PRL_CLOCK=tsc is not supported on this platform; using monotonic\n", stderr);
+        global_state.clock = prl_clock_monotonic;
+#endif
+    }
+
+    const int samples = 1000;
+    prl_time_t start = timestamp_force();
+    for (int i = 0; i < samples; i += 1)
+        timestamp_force();
+    prl_time_t stop = timestamp_force();
+    global_state.timestamp_cost = (double)(stop - start) / (samples + 1);
+}
+
 static prl_time_t timestamp() {
-    if (!global_state.config.cpu_profiling)
+    if (!PRL_PROFILING || !global_state.config.cpu_profiling)
         return 0;
 
 	return timestamp_force();
@@ -775,6 +1313,8 @@ static struct prl_stat *scopstat(prl_scop_instance scopinst) {
 
 static void add_time(prl_scop_instance scopinst, enum prl_stat_entry entry, prl_time_t duration) {
     assert(duration >= 0);
+    if (!PRL_PROFILING)
+        return;
 
     scopstat(scopinst)->entries[entry] += duration;
     scopstat(scopinst)->counts[entry] += 1;
@@ -782,11 +1322,21 @@ static void add_time(prl_scop_instance scopinst, enum prl_stat_entry entry, prl_
     global_state.global_stat.counts[entry] += 1;
 }
 
+static void add_counter(prl_scop_instance scopinst, enum prl_counter_entry entry, uint64_t amount) {
+    if (!PRL_PROFILING)
+        return;
+    scopstat(scopinst)->counters[entry] += amount;
+    global_state.global_stat.counters[entry] += amount;
+}
+
 static bool cpu_tracing() {
-    return global_state.config.cpu_detailed_profiling;
+    return PRL_PROFILING && global_state.config.cpu_detailed_profiling;
 }
 
 static void trace_result(prl_scop_instance scopinst, enum prl_stat_entry entry, prl_time_t duration, cl_int err) {
+    if (!PRL_PROFILING)
+        return;
+
     if (global_state.config.cpu_profiling)
         add_time(scopinst, entry, duration);
 
@@ -821,6 +1371,7 @@ static void clReleaseMemObject_checked(prl_scop_instance scopinst, cl_mem memobj
     prl_time_t start = timestamp();
     cl_int err = clReleaseMemObject(memobj);
     prl_time_t stop = timestamp();
+    global_state.clmem_release_gen += 1;
 
     trace_result(scopinst, stat_cpu_clReleaseMemObject, stop - start, err);
 
@@ -828,6 +1379,24 @@ static void clReleaseMemObject_checked(prl_scop_instance scopinst, cl_mem memobj
         opencl_error(err, stat_cpu_clReleaseMemObject);
 }
 
+static void clRetainMemObject_checked(prl_scop_instance scopinst, cl_mem memobj) {
+    assert(memobj);
+
+    if (cpu_tracing()) {
+        printf("clRetainMemObject(memobj=%p)", memobj);
+        fflush(stdout);
+    }
+
+    prl_time_t start = timestamp();
+    cl_int err = clRetainMemObject(memobj);
+    prl_time_t stop = timestamp();
+
+    trace_result(scopinst, stat_cpu_clRetainMemObject, stop - start, err);
+
+    if (err != CL_SUCCESS)
+        opencl_error(err, stat_cpu_clRetainMemObject);
+}
+
 static cl_command_queue clCreateCommandQueue_checked(prl_scop_instance scopinst, cl_context context, cl_device_id device, cl_command_queue_properties properties) {
     assert(context);
     cl_int err = CL_INT_MIN;
@@ -1005,6 +1574,143 @@ static void clEnqueueReadBuffer_checked(prl_scop_instance scopinst, cl_command_q
         opencl_error(err, stat_cpu_clEnqueueReadBuffer);
 }
 
+static void clEnqueueCopyBuffer_checked(prl_scop_instance scopinst, cl_command_queue command_queue,
+                                        cl_mem src_buffer,
+                                        cl_mem dst_buffer,
+                                        size_t src_offset,
+                                        size_t dst_offset,
+                                        size_t size,
+                                        cl_uint num_events_in_wait_list,
+                                        const cl_event *event_wait_list,
+                                        cl_event *event) {
+    assert(command_queue);
+    assert(src_buffer);
+    assert(dst_buffer);
+
+    if (cpu_tracing()) {
+        printf("clEnqueueCopyBuffer(command_queue=%p, src_buffer=%p, dst_buffer=%p, src_offset=%zu, dst_offset=%zu, size=%zu, num_events_in_wait_list=%" PRIu32 ", event_wait_list=",
+               command_queue, src_buffer, dst_buffer, src_offset, dst_offset, size, num_events_in_wait_list);
+        print_ptr_array(num_events_in_wait_list, (const void **)event_wait_list);
+        printf(")");
+        fflush(stdout);
+    }
+
+    if (event)
+        *event = NULL;
+
+    prl_time_t start = timestamp();
+    cl_int err = clEnqueueCopyBuffer(command_queue, src_buffer, dst_buffer, src_offset, dst_offset, size, num_events_in_wait_list, event_wait_list, event);
+    prl_time_t stop = timestamp();
+
+    if (cpu_tracing() && err == CL_SUCCESS)
+        if (event)
+            printf(" -> event=%p", *event);
+    trace_result(scopinst, stat_cpu_clEnqueueCopyBuffer, stop - start, err);
+
+    if (err != CL_SUCCESS)
+        opencl_error(err, stat_cpu_clEnqueueCopyBuffer);
+}
+
+static void clEnqueueWriteBufferRect_checked(prl_scop_instance scopinst, cl_command_queue command_queue,
+                                             cl_mem buffer,
+                                             cl_bool blocking_write,
+                                             const size_t *buffer_origin,
+                                             const size_t *host_origin,
+                                             const size_t *region,
+                                             size_t buffer_row_pitch,
+                                             size_t buffer_slice_pitch,
+                                             size_t host_row_pitch,
+                                             size_t host_slice_pitch,
+                                             const void *ptr,
+                                             cl_uint num_events_in_wait_list,
+                                             const cl_event *event_wait_list,
+                                             cl_event *event) {
+    assert(command_queue);
+    assert(buffer);
+    assert(buffer_origin);
+    assert(host_origin);
+    assert(region);
+
+    if (cpu_tracing()) {
+        printf("clEnqueueWriteBufferRect(command_queue=%p, buffer=%p, blocking_write=%" PRIu32 ", buffer_origin=", command_queue, buffer, blocking_write);
+        print_sizet_array(3, buffer_origin);
+        printf(", host_origin=");
+        print_sizet_array(3, host_origin);
+        printf(", region=");
+        print_sizet_array(3, region);
+        printf(", buffer_row_pitch=%zu, buffer_slice_pitch=%zu, host_row_pitch=%zu, host_slice_pitch=%zu, ptr=%p, num_events_in_wait_list=%" PRIu32 ", event_wait_list=",
+               buffer_row_pitch, buffer_slice_pitch, host_row_pitch, host_slice_pitch, ptr, num_events_in_wait_list);
+        print_ptr_array(num_events_in_wait_list, (const void **)event_wait_list);
+        printf(")");
+        fflush(stdout);
+    }
+
+    if (event)
+        *event = NULL;
+
+    prl_time_t start = timestamp();
+    cl_int err = clEnqueueWriteBufferRect(command_queue, buffer, blocking_write, buffer_origin, host_origin, region, buffer_row_pitch, buffer_slice_pitch, host_row_pitch, host_slice_pitch, ptr, num_events_in_wait_list, event_wait_list, event);
+    prl_time_t stop = timestamp();
+
+    if (cpu_tracing() && err == CL_SUCCESS)
+        if (event)
+            printf(" -> event=%p", *event);
+    trace_result(scopinst, stat_cpu_clEnqueueWriteBufferRect, stop - start, err);
+
+    if (err != CL_SUCCESS)
+        opencl_error(err, stat_cpu_clEnqueueWriteBufferRect);
+}
+
+static void clEnqueueReadBufferRect_checked(prl_scop_instance scopinst, cl_command_queue command_queue,
+                                            cl_mem buffer,
+                                            cl_bool blocking_read,
+                                            const size_t *buffer_origin,
+                                            const size_t *host_origin,
+                                            const size_t *region,
+                                            size_t buffer_row_pitch,
+                                            size_t buffer_slice_pitch,
+                                            size_t host_row_pitch,
+                                            size_t host_slice_pitch,
+                                            void *ptr,
+                                            cl_uint num_events_in_wait_list,
+                                            const cl_event *event_wait_list,
+                                            cl_event *event) {
+    assert(command_queue);
+    assert(buffer);
+    assert(buffer_origin);
+    assert(host_origin);
+    assert(region);
+
+    if (cpu_tracing()) {
+        printf("clEnqueueReadBufferRect(command_queue=%p, buffer=%p, blocking_read=%" PRIu32 ", buffer_origin=", command_queue, buffer, blocking_read);
+        print_sizet_array(3, buffer_origin);
+        printf(", host_origin=");
+        print_sizet_array(3, host_origin);
+        printf(", region=");
+        print_sizet_array(3, region);
+        printf(", buffer_row_pitch=%zu, buffer_slice_pitch=%zu, host_row_pitch=%zu, host_slice_pitch=%zu, ptr=%p, num_events_in_wait_list=%" PRIu32 ", event_wait_list=",
+               buffer_row_pitch, buffer_slice_pitch, host_row_pitch, host_slice_pitch, ptr, num_events_in_wait_list);
+        print_ptr_array(num_events_in_wait_list, (const void **)event_wait_list);
+        printf(")");
+        fflush(stdout);
+    }
+
+    if (event)
+        *event = NULL;
+
+    prl_time_t start = timestamp();
+    cl_int err = clEnqueueReadBufferRect(command_queue, buffer, blocking_read, buffer_origin, host_origin, region, buffer_row_pitch, buffer_slice_pitch, host_row_pitch, host_slice_pitch, ptr, num_events_in_wait_list, event_wait_list, event);
+    prl_time_t stop = timestamp();
+
+    if (cpu_tracing() && err == CL_SUCCESS)
+        if (event)
+            printf(" -> event=%p", *event);
+    trace_result(scopinst, stat_cpu_clEnqueueReadBufferRect, stop - start, err);
+
+    if (err != CL_SUCCESS)
+        opencl_error(err, stat_cpu_clEnqueueReadBufferRect);
+}
+
 static void clEnqueueNDRangeKernel_checked(prl_scop_instance scopinst, cl_command_queue command_queue,
                                            cl_kernel kernel,
                                            cl_uint work_dim,
@@ -1104,6 +1810,71 @@ static void clFinish_checked(prl_scop_instance scopinst, cl_command_queue comman
         opencl_error(err, stat_cpu_clFinish);
 }
 
+static void clFlush_checked(prl_scop_instance scopinst, cl_command_queue command_queue) {
+    assert(command_queue);
+
+    if (cpu_tracing()) {
+        printf("clFlush(command_queue=%p)", command_queue);
+        fflush(stdout);
+    }
+
+    prl_time_t start = timestamp();
+    cl_int err = clFlush(command_queue);
+    prl_time_t stop = timestamp();
+
+    trace_result(scopinst, stat_cpu_clFlush, stop - start, err);
+
+    if (err != CL_SUCCESS)
+        opencl_error(err, stat_cpu_clFlush);
+}
+
+static cl_event clEnqueueMarker_checked(prl_scop_instance scopinst, cl_command_queue command_queue) {
+    assert(command_queue);
+
+    if (cpu_tracing()) {
+        printf("clEnqueueMarker(command_queue=%p)", command_queue);
+        fflush(stdout);
+    }
+
+    cl_event event = NULL;
+    prl_time_t start = timestamp();
+#ifdef CL_VERSION_1_2
+    cl_int err = clEnqueueMarkerWithWaitList(command_queue, 0, NULL, &event);
+#else
+    cl_int err = clEnqueueMarker(command_queue, &event);
+#endif
+    prl_time_t stop = timestamp();
+
+    if (cpu_tracing() && err == CL_SUCCESS) {
+        printf(" -> %p", event);
+    }
+    trace_result(scopinst, stat_cpu_clEnqueueMarker, stop - start, err);
+
+    if (err != CL_SUCCESS)
+        opencl_error(err, stat_cpu_clEnqueueMarker);
+    assert(event);
+    return event;
+}
+
+static void clSetEventCallback_checked(prl_scop_instance scopinst, cl_event event, cl_int command_exec_callback_type, void(CL_CALLBACK *pfn_event_notify)(cl_event, cl_int, void *), void *user_data) {
+    assert(event);
+    assert(pfn_event_notify);
+
+    if (cpu_tracing()) {
+        printf("clSetEventCallback(event=%p, command_exec_callback_type=%" PRIi32 ", user_data=%p)", event, command_exec_callback_type, user_data);
+        fflush(stdout);
+    }
+
+    prl_time_t start = timestamp();
+    cl_int err = clSetEventCallback(event, command_exec_callback_type, pfn_event_notify, user_data);
+    prl_time_t stop = timestamp();
+
+    trace_result(scopinst, stat_cpu_clSetEventCallback, stop - start, err);
+
+    if (err != CL_SUCCESS)
+        opencl_error(err, stat_cpu_clSetEventCallback);
+}
+
 static void clReleaseCommandQueue_checked(prl_scop_instance scopinst, cl_command_queue command_queue) {
     assert(command_queue);
 
@@ -1472,26 +2243,46 @@ static void clGetProgramBuildInfo_checked(prl_scop_instance scopinst, cl_program
         opencl_error(err, stat_cpu_clGetProgramBuildInfo);
 }
 
-static bool clBuildProgram_checked(prl_scop_instance scopinst, cl_program program,
-                                   cl_uint num_devices,
-                                   const cl_device_id *device_list,
-                                   const char *options,
-                                   void (*pfn_notify)(cl_program, void *user_data),
-                                   void *user_data) {
-    assert(program);
+static void clGetKernelWorkGroupInfo_checked(prl_scop_instance scopinst, cl_kernel kernel, cl_device_id device, cl_kernel_work_group_info param_name, size_t param_value_size, void *param_value, size_t *param_value_size_ret) {
+    assert(kernel);
 
     if (cpu_tracing()) {
-        printf("clBuildProgram(program=%p, num_devices=%" PRIu32 ", device_list=", program, num_devices);
-        print_ptr_array(num_devices, (const void *const *)device_list);
-        printf(", options=%s, pfn_notify=%p, user_data=%p)", options, pfn_notify, user_data);
+        printf("clGetKernelWorkGroupInfo(kernel=%p, device=%p, param_name=%" PRIu32 ", param_value_size=%zu)", kernel, device, param_name, param_value_size);
         fflush(stdout);
     }
 
     prl_time_t start = timestamp();
-    cl_int err = clBuildProgram(program, num_devices, device_list, options, pfn_notify, user_data);
+    cl_int err = clGetKernelWorkGroupInfo(kernel, device, param_name, param_value_size, param_value, param_value_size_ret);
     prl_time_t stop = timestamp();
 
-    trace_result(scopinst, stat_cpu_clBuildProgram, stop - start, err);
+    if (cpu_tracing() && err == CL_SUCCESS)
+        printf(" -> ?");
+    trace_result(scopinst, stat_cpu_clGetKernelWorkGroupInfo, stop - start, err);
+
+    if (err != CL_SUCCESS)
+        opencl_error(err, stat_cpu_clGetKernelWorkGroupInfo);
+}
+
+static bool clBuildProgram_checked(prl_scop_instance scopinst, cl_program program,
+                                   cl_uint num_devices,
+                                   const cl_device_id *device_list,
+                                   const char *options,
+                                   void (*pfn_notify)(cl_program, void *user_data),
+                                   void *user_data) {
+    assert(program);
+
+    if (cpu_tracing()) {
+        printf("clBuildProgram(program=%p, num_devices=%" PRIu32 ", device_list=", program, num_devices);
+        print_ptr_array(num_devices, (const void *const *)device_list);
+        printf(", options=%s, pfn_notify=%p, user_data=%p)", options, pfn_notify, user_data);
+        fflush(stdout);
+    }
+
+    prl_time_t start = timestamp();
+    cl_int err = clBuildProgram(program, num_devices, device_list, options, pfn_notify, user_data);
+    prl_time_t stop = timestamp();
+
+    trace_result(scopinst, stat_cpu_clBuildProgram, stop - start, err);
 
     return err!=CL_SUCCESS;
 }
@@ -1523,20 +2314,183 @@ static void free_checked(prl_scop_instance scopinst, void *ptr) {
     add_time(scopinst, stat_cpu_free, stop - start);
 }
 
+// MurmurHash3 finalizer
+static uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= UINT64_C(0xFF51AFD7ED558CCD);
+    h ^= h >> 33;
+    h *= UINT64_C(0xC4CEB9FE1A85EC53);
+    h ^= h >> 33;
+    return h;
+}
+
+// Not cryptographic; two 64-bit lanes that both depend on every word
+static void dedup_hash(const void *data, size_t size, uint64_t result[2]) {
+    const unsigned char *bytes = data;
+    uint64_t h0 = UINT64_C(0x9E3779B97F4A7C15) ^ size;
+    uint64_t h1 = UINT64_C(0xC2B2AE3D27D4EB4F) ^ size;
+
+    for (size_t i = 0; i < size; i += 16) {
+        uint64_t w[2] = {0, 0};
+        memcpy(w, bytes + i, (size - i < 16) ? size - i : 16);
+
+        h0 ^= w[0];
+        h0 = ((h0 << 31) | (h0 >> 33)) * UINT64_C(0x87C37B91114253D5) + w[1];
+        h1 ^= w[1];
+        h1 = ((h1 << 27) | (h1 >> 37)) * UINT64_C(0x4CF5AD432745937F) + w[0];
+    }
+
+    h0 += h1;
+    h1 += h0;
+    result[0] = fmix64(h0);
+    result[1] = fmix64(h1);
+}
+
+static void content_hash(prl_scop_instance scopinst, const void *data, size_t size, uint64_t result[2]) {
+    prl_time_t start = timestamp();
+    dedup_hash(data, size, result);
+    prl_time_t stop = timestamp();
+    if (global_state.config.cpu_profiling)
+        add_time(scopinst, stat_cpu_content_hash, stop - start);
+    add_counter(scopinst, counter_bytes_hashed, size);
+}
+
+static struct prl_buffer_stat *buffer_stat_lookup(const char *name) {
+    for (size_t i = 0; i < global_state.buffer_stats_size; i += 1) {
+        if (!strcmp(global_state.buffer_stats[i]->name, name))
+            return global_state.buffer_stats[i];
+    }
+
+    struct prl_buffer_stat *stat = malloc_checked(NOSCOPINST, sizeof *stat);
+    memset(stat, 0, sizeof *stat);
+    size_t len = strlen(name);
+    stat->name = malloc_checked(NOSCOPINST, len + 1);
+    memcpy(stat->name, name, len + 1);
+
+    global_state.buffer_stats_size += 1;
+    global_state.buffer_stats = realloc_checked(NOSCOPINST, global_state.buffer_stats, global_state.buffer_stats_size * sizeof *global_state.buffer_stats);
+    global_state.buffer_stats[global_state.buffer_stats_size - 1] = stat;
+    return stat;
+}
+
+// Account a transfer of a mem in the global and per-buffer statistics
+static void count_transfer(prl_scop_instance scopinst, prl_mem mem, enum transfer_dir dir, uint64_t bytes) {
+    add_counter(scopinst, (dir == dir_to_device) ? counter_bytes_to_device : counter_bytes_to_host, bytes);
+    if (!PRL_PROFILING || !mem->name)
+        return;
+
+    if (!mem->buffer_stat)
+        mem->buffer_stat = buffer_stat_lookup(mem->name);
+    struct prl_buffer_stat *stat = mem->buffer_stat;
+    stat->bytes[dir] += bytes;
+    stat->transfers[dir] += 1;
+
+    uint64_t instance = scopinst ? scopinst->serial : 0;
+    if (stat->any_transfer && stat->last_dir == dir_to_host && dir == dir_to_device) {
+        if (instance && instance == stat->last_instance)
+            stat->roundtrips_inside += 1;
+        else
+            stat->roundtrips_across += 1;
+    }
+    stat->any_transfer = true;
+    stat->last_dir = dir;
+    stat->last_instance = instance;
+
+    if (global_state.config.advise && dir == dir_to_device && bytes == mem->size && mem->host_mem) {
+        uint64_t hash[2];
+        content_hash(scopinst, mem->host_mem, mem->size, hash);
+        if (stat->any_upload && hash[0] == stat->upload_hash[0] && hash[1] == stat->upload_hash[1]) {
+            stat->unchanged_uploads += 1;
+            stat->unchanged_bytes += bytes;
+        }
+        stat->any_upload = true;
+        stat->upload_hash[0] = hash[0];
+        stat->upload_hash[1] = hash[1];
+    }
+}
+
 static bool any_profiling() {
-    return global_state.config.cpu_profiling || global_state.config.gpu_profiling || global_state.config.gpu_detailed_profiling;
+    return PRL_PROFILING && (global_state.config.cpu_profiling || global_state.config.gpu_profiling || global_state.config.gpu_detailed_profiling);
 }
 
 static bool any_gpu_profiling() {
-    return global_state.config.gpu_profiling || global_state.config.gpu_detailed_profiling;
+    return PRL_PROFILING && (global_state.config.gpu_profiling || global_state.config.gpu_detailed_profiling);
+}
+
+static bool progress_thread_enabled() {
+    return global_state.config.progress_thread;
 }
 
-static bool need_events() {
-    return any_gpu_profiling();
+// Commands of unsampled SCoP instances are not profiled (PRL_PROF_SAMPLE)
+static bool is_profiled(prl_scop_instance scopinst) {
+    return !scopinst || scopinst->profiled;
 }
 
-static bool need_store_events() {
-    return global_state.config.gpu_profiling;
+static bool need_events(prl_scop_instance scopinst) {
+    return (any_gpu_profiling() && is_profiled(scopinst)) || progress_thread_enabled();
+}
+
+static bool need_store_events(prl_scop_instance scopinst) {
+    return global_state.config.gpu_profiling && is_profiled(scopinst) && !progress_thread_enabled();
+}
+
+// Whether to profile the next instance of the SCoP
+static bool sample_instance(prl_scop scop) {
+    global_state.sample_instances += 1;
+    scop->sample_entered += 1;
+
+    bool sampled;
+    if (global_state.config.prof_sample_fraction > 0) {
+        // xorshift64
+        uint64_t x = global_state.sample_random;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        global_state.sample_random = x;
+        sampled = (x >> 11) * (1.0 / 9007199254740992.0) < global_state.config.prof_sample_fraction;
+    } else {
+        int every = global_state.config.prof_sample;
+        sampled = every <= 1 || (scop->sample_entered - 1) % every == 0;
+    }
+
+    if (sampled)
+        global_state.sample_profiled += 1;
+    return sampled || global_state.config.gpu_detailed_profiling;
+}
+
+// Factor to extrapolate a GPU statistic of sampled instances to all instances; each SCoP's share is scaled by its own sampling ratio.
+// With window, only for what has been accumulated since the previous prl_perf_dump_window.
+static double sample_scale_since(enum prl_stat_entry entry, bool window) {
+    prl_time_t profiled = global_state.global_stat.entries[entry];
+    if (window)
+        profiled -= global_state.window_stat.entries[entry];
+    if (profiled == 0 || global_state.config.gpu_detailed_profiling)
+        return 1;
+    double extrapolated = profiled;
+    for (prl_scop scop = global_state.scops; scop; scop = scop->next) {
+        prl_time_t scop_profiled = scop->stat.entries[entry];
+        int instances = scop->instances;
+        int profiled_instances = scop->profiled_instances;
+        if (window) {
+            scop_profiled -= scop->window_entries[entry];
+            instances -= scop->window_instances;
+            profiled_instances -= scop->window_profiled_instances;
+        }
+        if (profiled_instances > 0)
+            extrapolated += scop_profiled * ((double)instances / profiled_instances - 1);
+    }
+    return extrapolated / profiled;
+}
+
+static double sample_scale(enum prl_stat_entry entry) {
+    return sample_scale_since(entry, false);
+}
+
+// Factor to extrapolate the times of a kernel's profiled launches to all its launches
+static double kernel_gpu_scale(prl_kernel kernel) {
+    if (kernel->total_count == 0 || kernel->launches <= kernel->total_count)
+        return 1;
+    return (double)kernel->launches / kernel->total_count;
 }
 
 //RENAME: config_blocking
@@ -1553,6 +2507,7 @@ static void push_back_mem(prl_scop_instance scopinst, prl_mem mem) {
     scopinst->mems = realloc_checked(scopinst, scopinst->mems, new_size * sizeof *scopinst->mems);
     scopinst->mems[old_size] = mem;
     scopinst->mems_size += 1;
+    mem->scop_refs += 1;
 }
 
 static void stat_compute_medians(double medians[static const restrict STAT_ENTRIES], double relstddevs[static const restrict STAT_ENTRIES], size_t n, struct prl_stat data[static const restrict n]) {
@@ -1609,6 +2564,7 @@ static bool is_valid_loc(prl_mem mem) {
         return (mem->loc == loc_none) ||
                (mem->loc == loc_host) ||
                (mem->loc == loc_dev) ||
+               (mem->loc == loc_shared) ||
                (mem->loc == loc_transferring_to_dev) ||
                (mem->loc == loc_transferring_to_host);
     case alloc_type_map:
@@ -1636,19 +2592,27 @@ static void dump_finished_kernel_event(cl_command_type cmdty, prl_kernel kernel,
     printf("Compute %s %s: %fms (%s)\n", srcfile, kernelname, duration * 0.000001, cmdtype_to_str(cmdty));
 }
 
-static void dump_finished_transfer_event(cl_command_type cmdty, prl_mem mem, prl_time_t duration) {
-    assert(is_valid_loc(mem));
+static bool is_prof_kind(enum prof_kind prof_kind, cl_command_type cmdty) {
+    switch (prof_kind) {
+    case prof_all:
+        return true;
+    case prof_to_device:
+        return (cmdty == CL_COMMAND_WRITE_BUFFER) || (cmdty == CL_COMMAND_WRITE_BUFFER_RECT) || (cmdty == CL_COMMAND_WRITE_IMAGE) || (cmdty == CL_COMMAND_UNMAP_MEM_OBJECT);
+    case prof_compute:
+        return (cmdty == CL_COMMAND_NDRANGE_KERNEL) || (cmdty == CL_COMMAND_TASK) || (cmdty == CL_COMMAND_NATIVE_KERNEL);
+    case prof_to_host:
+        return (cmdty == CL_COMMAND_READ_BUFFER) || (cmdty == CL_COMMAND_READ_BUFFER_RECT) || (cmdty == CL_COMMAND_READ_IMAGE) || (cmdty == CL_COMMAND_MAP_BUFFER) || (cmdty == CL_COMMAND_MAP_IMAGE);
+    }
+    return false;
+}
 
-    enum prl_alloc_current_location direction = mem->loc & loc_mask_transferring;
-    const char *dirstr = "unkown transfer";
-    switch (direction) {
-    case loc_transferring_to_dev:
+static void dump_finished_transfer_event(cl_command_type cmdty, prl_mem mem, prl_time_t duration) {
+    // mem->loc might not tell anymore once the transfer has been retired
+    const char *dirstr = "unknown transfer";
+    if (is_prof_kind(prof_to_device, cmdty))
         dirstr = "host->dev";
-        break;
-    case loc_transferring_to_host:
+    else if (is_prof_kind(prof_to_host, cmdty))
         dirstr = "dev->host";
-        break;
-    }
     const char *cmdstr = statname[clcommand_to_stat_entry(cmdty)];
 
     if (mem->name)
@@ -1661,6 +2625,46 @@ static void report_trace(const char *cmdstr, prl_time_t duration) {
     printf("%s: %fms\n", cmdstr, duration * 0.000001);
 }
 
+static int latency_bucket(prl_time_t latency) {
+    int bucket = 0;
+    while (latency > 1 && bucket < LATENCY_BUCKETS - 1) {
+        latency >>= 1;
+        bucket += 1;
+    }
+    return bucket;
+}
+
+static void latency_hist_merge(struct prl_latency_hist *hist, const struct prl_latency_hist *other) {
+    hist->count += other->count;
+    hist->queue_total += other->queue_total;
+    hist->submit_total += other->submit_total;
+    for (int i = 0; i < LATENCY_BUCKETS; i += 1) {
+        hist->queue[i] += other->queue[i];
+        hist->submit[i] += other->submit[i];
+    }
+}
+
+static void latency_hist_add(struct prl_latency_hist *hist, prl_time_t queue_latency, prl_time_t submit_latency) {
+    hist->count += 1;
+    hist->queue_total += queue_latency;
+    hist->submit_total += submit_latency;
+    hist->queue[latency_bucket(queue_latency)] += 1;
+    hist->submit[latency_bucket(submit_latency)] += 1;
+}
+
+// Record the latencies of a command into the histograms; returns false if the implementation reported inconsistent timestamps
+static bool record_latency(enum prl_stat_entry entry, prl_kernel kernel, cl_ulong queued, cl_ulong submit, cl_ulong start, prl_time_t *queue_latency, prl_time_t *submit_latency) {
+    if (!queued || queued > submit || submit > start)
+        return false;
+
+    *queue_latency = submit - queued;
+    *submit_latency = start - submit;
+    latency_hist_add(&global_state.latency[entry], *queue_latency, *submit_latency);
+    if (kernel)
+        latency_hist_add(&kernel->latency, *queue_latency, *submit_latency);
+    return true;
+}
+
 static void dump_finished_event(struct prl_pending_event *pendev, cl_command_type cmdty, prl_time_t duration) {
     switch (pendev->type) {
     case pending_compute:
@@ -1686,7 +2690,7 @@ static bool has_event_completed(prl_scop_instance scopinst, cl_event event) {
 
 static bool has_transfer_completed(prl_scop_instance scopinst, prl_mem mem) {
     assert(mem);
-	assert(need_store_events() && "Events must not been already freed");
+	assert(need_store_events(scopinst) && "Events must not been already freed");
     return has_event_completed(scopinst, mem->transferevent);
 }
 
@@ -1719,24 +2723,357 @@ static void report_finished_event(prl_scop_instance scopinst, cl_event event, pr
     dump_finished_event(&pendev, cmdty, duration);
 }
 
+// GPU time of a finished transfer
+static void count_transfer_duration(prl_mem mem, cl_command_type cmdty, prl_time_t duration) {
+    if (!mem->buffer_stat)
+        return;
+    if (is_prof_kind(prof_to_device, cmdty))
+        mem->buffer_stat->duration[dir_to_device] += duration;
+    else if (is_prof_kind(prof_to_host, cmdty))
+        mem->buffer_stat->duration[dir_to_host] += duration;
+}
+
+// Commands have to be added in order of their start time
+static void accumulate_gpu_duration(struct gpu_durations *acc, prl_time_t start, prl_time_t stop) {
+    assert(start <= stop);
+
+    if (!acc->started) {
+        acc->prev_stop = start;
+        acc->started = true;
+    }
+
+    if (acc->prev_stop <= start) {
+        // Case 1: |<- prev ->|  |<- cur ->|
+        acc->working += stop - start;
+        acc->idle += start - acc->prev_stop;
+        acc->prev_stop = stop;
+    } else if (stop <= acc->prev_stop) {
+        // Case 2: |<-   prev   ->|
+        //           |<- cur ->|
+    } else {
+        // Case 3: |<- prev ->|
+        //                |<- cur ->|
+        assert(start <= acc->prev_stop);
+        acc->working += stop - acc->prev_stop;
+        acc->prev_stop = stop;
+    }
+}
+
+#ifdef PRL_HAVE_PTHREADS
+// Called on the progress thread with progress_mutex held.
+// Only updates the instance's aggregates, whose size is bounded by the kernels and buffers it uses; does not use the *_checked wrappers since the statistics they update are owned by the main thread.
+static void progress_retire(struct prl_progress_event *progev) {
+    struct prl_pending_event *pendev = &progev->pendev;
+    prl_scop_instance scopinst = progev->scopinst;
+    cl_event event = pendev->event;
+    cl_int err;
+
+    if (any_gpu_profiling() && is_profiled(scopinst)) {
+        cl_ulong start, stop;
+        cl_command_type cmdty;
+        err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        if (err != CL_SUCCESS)
+            opencl_error(err, stat_cpu_clGetEventProfilingInfo);
+        err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(stop), &stop, NULL);
+        if (err != CL_SUCCESS)
+            opencl_error(err, stat_cpu_clGetEventProfilingInfo);
+        err = clGetEventInfo(event, CL_EVENT_COMMAND_TYPE, sizeof(cmdty), &cmdty, NULL);
+        if (err != CL_SUCCESS)
+            opencl_error(err, stat_cpu_clGetEventInfo);
+        assert(start <= stop);
+        prl_time_t duration = stop - start;
+
+        if (global_state.config.gpu_profiling) {
+            cl_ulong queued, submit;
+            err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+            if (err != CL_SUCCESS)
+                opencl_error(err, stat_cpu_clGetEventProfilingInfo);
+            err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL);
+            if (err != CL_SUCCESS)
+                opencl_error(err, stat_cpu_clGetEventProfilingInfo);
+
+            enum prl_stat_entry entry = clcommand_to_stat_entry(cmdty);
+            scopinst->progress_stat.entries[entry] += duration;
+            scopinst->progress_stat.counts[entry] += 1;
+
+            // Assumes that events complete in the order they started, as they do on in-order queues
+            for (int k = 0; k < PROF_KINDS; k += 1) {
+                if (is_prof_kind(k, cmdty))
+                    accumulate_gpu_duration(&scopinst->progress_durations[k], start, stop);
+            }
+
+            struct prl_progress_kernel *kernelacc = NULL;
+            if (pendev->type == pending_compute) {
+                kernelacc = &scopinst->progress_kernels[progev->slot];
+                assert(kernelacc->kernel == pendev->kernel);
+                kernelacc->total_duration += duration;
+                kernelacc->total_count += 1;
+                kernelacc->duration_hist[latency_bucket(duration)] += 1;
+            }
+            if (pendev->type == pending_transfer && progev->slot != SIZE_MAX) {
+                struct prl_progress_transfer *transferacc = &scopinst->progress_transfers[progev->slot];
+                if (is_prof_kind(prof_to_device, cmdty))
+                    transferacc->duration[dir_to_device] += duration;
+                else if (is_prof_kind(prof_to_host, cmdty))
+                    transferacc->duration[dir_to_host] += duration;
+            }
+
+            // Same as record_latency, into the instance's histograms
+            if (queued && queued <= submit && submit <= start && entry >= stat_gpu_NDRANGE_KERNEL) {
+                prl_time_t queue_latency = submit - queued;
+                prl_time_t submit_latency = start - submit;
+                latency_hist_add(&scopinst->progress_latency[entry - stat_gpu_NDRANGE_KERNEL], queue_latency, submit_latency);
+                if (kernelacc)
+                    latency_hist_add(&kernelacc->latency, queue_latency, submit_latency);
+                scopinst->progress_stat.entries[stat_gpu_queue_latency] += queue_latency;
+                scopinst->progress_stat.counts[stat_gpu_queue_latency] += 1;
+                scopinst->progress_stat.entries[stat_gpu_submit_latency] += submit_latency;
+                scopinst->progress_stat.counts[stat_gpu_submit_latency] += 1;
+            }
+        }
+
+        // Kernel and buffer names do not change while the instance is active; stdout is locked by printf
+        if (global_state.config.gpu_detailed_profiling && !pendev->reported)
+            dump_finished_event(pendev, cmdty, duration);
+    }
+
+    // Events are not kept for the main thread; progress_submit made sure that mem->transferevent does not refer to it
+    err = clReleaseEvent(event);
+    if (err != CL_SUCCESS)
+        opencl_error(err, stat_cpu_clReleaseEvent);
+
+    assert(scopinst->progress_inflight > 0);
+    scopinst->progress_inflight -= 1;
+}
+
+static void *progress_main(void *arg) {
+    pthread_mutex_lock(&global_state.progress_mutex);
+    while (true) {
+        struct prl_progress_event *progev = global_state.progress_first;
+        if (!progev) {
+            if (global_state.progress_stop)
+                break;
+            pthread_cond_wait(&global_state.progress_queued, &global_state.progress_mutex);
+            continue;
+        }
+
+        global_state.progress_first = progev->next;
+        if (!global_state.progress_first)
+            global_state.progress_last = NULL;
+
+        progress_retire(progev);
+        free(progev); // Not free_checked: we are on a different thread
+        pthread_cond_broadcast(&global_state.progress_retired);
+    }
+    pthread_mutex_unlock(&global_state.progress_mutex);
+    return NULL;
+}
+
+static void CL_CALLBACK progress_notify(cl_event event, cl_int event_command_exec_status, void *user_data) {
+    struct prl_progress_event *progev = user_data;
+
+    pthread_mutex_lock(&global_state.progress_mutex);
+    progev->next = NULL;
+    if (global_state.progress_last)
+        global_state.progress_last->next = progev;
+    else
+        global_state.progress_first = progev;
+    global_state.progress_last = progev;
+    pthread_cond_signal(&global_state.progress_queued);
+    pthread_mutex_unlock(&global_state.progress_mutex);
+}
+#endif /* PRL_HAVE_PTHREADS */
+
+static void progress_start() {
+#ifdef PRL_HAVE_PTHREADS
+    pthread_mutex_init(&global_state.progress_mutex, NULL);
+    pthread_cond_init(&global_state.progress_queued, NULL);
+    pthread_cond_init(&global_state.progress_retired, NULL);
+    global_state.progress_first = NULL;
+    global_state.progress_last = NULL;
+    global_state.progress_stop = false;
+
+    if (pthread_create(&global_state.progress_thread, NULL, &progress_main, NULL) != 0) {
+        fputs("Cannot start the PRL progress thread\n", stderr);
+        exit(1);
+    }
+#endif
+}
+
+// All SCoP instances must have been left
+static void progress_shutdown() {
+#ifdef PRL_HAVE_PTHREADS
+    pthread_mutex_lock(&global_state.progress_mutex);
+    global_state.progress_stop = true;
+    pthread_cond_signal(&global_state.progress_queued);
+    pthread_mutex_unlock(&global_state.progress_mutex);
+
+    pthread_join(global_state.progress_thread, NULL);
+    assert(!global_state.progress_first);
+
+    pthread_cond_destroy(&global_state.progress_retired);
+    pthread_cond_destroy(&global_state.progress_queued);
+    pthread_mutex_destroy(&global_state.progress_mutex);
+#endif
+}
+
+// Aggregate of the instance for the kernel or buffer of an event; called on the main thread with progress_mutex held
+static size_t progress_slot(prl_scop_instance scopinst, prl_mem mem, prl_kernel kernel) {
+    if (!scopinst->progress_latency) {
+        scopinst->progress_latency = malloc_checked(scopinst, STAT_GPU_COMMANDS * sizeof *scopinst->progress_latency);
+        memset(scopinst->progress_latency, 0, STAT_GPU_COMMANDS * sizeof *scopinst->progress_latency);
+    }
+
+    if (kernel) {
+        for (size_t i = 0; i < scopinst->progress_kernels_size; i += 1) {
+            if (scopinst->progress_kernels[i].kernel == kernel)
+                return i;
+        }
+        size_t slot = scopinst->progress_kernels_size;
+        scopinst->progress_kernels = realloc_checked(scopinst, scopinst->progress_kernels, (slot + 1) * sizeof *scopinst->progress_kernels);
+        memset(&scopinst->progress_kernels[slot], 0, sizeof *scopinst->progress_kernels);
+        scopinst->progress_kernels[slot].kernel = kernel;
+        scopinst->progress_kernels_size += 1;
+        return slot;
+    }
+
+    if (mem && mem->buffer_stat) {
+        for (size_t i = 0; i < scopinst->progress_transfers_size; i += 1) {
+            if (scopinst->progress_transfers[i].buffer_stat == mem->buffer_stat)
+                return i;
+        }
+        size_t slot = scopinst->progress_transfers_size;
+        scopinst->progress_transfers = realloc_checked(scopinst, scopinst->progress_transfers, (slot + 1) * sizeof *scopinst->progress_transfers);
+        memset(&scopinst->progress_transfers[slot], 0, sizeof *scopinst->progress_transfers);
+        scopinst->progress_transfers[slot].buffer_stat = mem->buffer_stat;
+        scopinst->progress_transfers_size += 1;
+        return slot;
+    }
+
+    return SIZE_MAX;
+}
+
+// Hand the event over to the progress thread, which retires it when it has completed
+static void progress_submit(prl_scop_instance scopinst, cl_event event, prl_mem mem, prl_kernel kernel, bool reported) {
+#ifdef PRL_HAVE_PTHREADS
+    struct prl_progress_event *progev = malloc(sizeof *progev); // Not malloc_checked: freed on the progress thread
+    assert(progev);
+    memset(progev, 0, sizeof *progev);
+    progev->scopinst = scopinst;
+    progev->pendev.event = event;
+    progev->pendev.type = pending_other;
+    progev->pendev.reported = reported;
+    assert(!(mem && kernel));
+    if (mem) {
+        progev->pendev.type = pending_transfer;
+        progev->pendev.mem = mem;
+    }
+    if (kernel) {
+        progev->pendev.type = pending_compute;
+        progev->pendev.kernel = kernel;
+    }
+
+    // The progress thread releases the event; the transfer's completion is applied when the instance is left (scop_leave_completed)
+    if (mem && mem->transferevent == event)
+        mem->transferevent = NULL;
+
+    pthread_mutex_lock(&global_state.progress_mutex);
+    progev->slot = SIZE_MAX;
+    if (global_state.config.gpu_profiling && is_profiled(scopinst))
+        progev->slot = progress_slot(scopinst, mem, kernel);
+    scopinst->progress_inflight += 1;
+    pthread_mutex_unlock(&global_state.progress_mutex);
+
+    clSetEventCallback_checked(scopinst, event, CL_COMPLETE, &progress_notify, progev);
+#else
+    assert(!"No progress thread on this platform");
+#endif
+}
+
+// Wait until the progress thread has retired all events of the instance and take over what it accumulated
+static void progress_wait(prl_scop_instance scopinst) {
+#ifdef PRL_HAVE_PTHREADS
+    if (!progress_thread_enabled())
+        return;
+
+    // Callbacks are only invoked for commands that have been submitted to the device
+    clFlush_checked(scopinst, scopinst->queue);
+
+    pthread_mutex_lock(&global_state.progress_mutex);
+    while (scopinst->progress_inflight > 0)
+        pthread_cond_wait(&global_state.progress_retired, &global_state.progress_mutex);
+    pthread_mutex_unlock(&global_state.progress_mutex);
+
+    if (!global_state.config.gpu_profiling)
+        return;
+
+    for (size_t i = 0; i < scopinst->progress_kernels_size; i += 1) {
+        struct prl_progress_kernel *kernelacc = &scopinst->progress_kernels[i];
+        prl_kernel kernel = kernelacc->kernel;
+        kernel->total_duration += kernelacc->total_duration;
+        kernel->total_count += kernelacc->total_count;
+        for (int j = 0; j < LATENCY_BUCKETS; j += 1)
+            kernel->duration_hist[j] += kernelacc->duration_hist[j];
+        latency_hist_merge(&kernel->latency, &kernelacc->latency);
+    }
+    free_checked(scopinst, scopinst->progress_kernels);
+    scopinst->progress_kernels = NULL;
+    scopinst->progress_kernels_size = 0;
+
+    for (size_t i = 0; i < scopinst->progress_transfers_size; i += 1) {
+        struct prl_progress_transfer *transferacc = &scopinst->progress_transfers[i];
+        transferacc->buffer_stat->duration[dir_to_device] += transferacc->duration[dir_to_device];
+        transferacc->buffer_stat->duration[dir_to_host] += transferacc->duration[dir_to_host];
+    }
+    free_checked(scopinst, scopinst->progress_transfers);
+    scopinst->progress_transfers = NULL;
+    scopinst->progress_transfers_size = 0;
+
+    if (scopinst->progress_latency) {
+        for (int i = 0; i < STAT_GPU_COMMANDS; i += 1)
+            latency_hist_merge(&global_state.latency[stat_gpu_NDRANGE_KERNEL + i], &scopinst->progress_latency[i]);
+        free_checked(scopinst, scopinst->progress_latency);
+        scopinst->progress_latency = NULL;
+    }
+
+    struct prl_stat *progress_stat = &scopinst->progress_stat;
+    for (int i = 0; i < STAT_ENTRIES; i += 1) {
+        scopinst->stat.entries[i] += progress_stat->entries[i];
+        scopinst->stat.counts[i] += progress_stat->counts[i];
+        global_state.global_stat.entries[i] += progress_stat->entries[i];
+        global_state.global_stat.counts[i] += progress_stat->counts[i];
+    }
+    memset(progress_stat, 0, sizeof *progress_stat);
+
+    add_time(scopinst, stat_gpu_working, scopinst->progress_durations[prof_all].working);
+    add_time(scopinst, stat_gpu_idle, scopinst->progress_durations[prof_all].idle);
+    add_time(scopinst, stat_gpu_transfer_to_device, scopinst->progress_durations[prof_to_device].working);
+    add_time(scopinst, stat_gpu_compute, scopinst->progress_durations[prof_compute].working);
+    add_time(scopinst, stat_gpu_transfer_to_host, scopinst->progress_durations[prof_to_host].working);
+    memset(scopinst->progress_durations, 0, sizeof scopinst->progress_durations);
+#endif
+}
+
 // Takes responsibility to free event
 static void push_back_event(prl_scop_instance scopinst, cl_event event, prl_mem mem, prl_kernel kernel, bool completed) {
     assert(scopinst);
 
     if (!event) {
-        assert(!need_store_events());
-        assert(!global_state.config.gpu_detailed_profiling);
+        assert(!need_store_events(scopinst));
+        assert(!global_state.config.gpu_detailed_profiling || !is_profiled(scopinst));
         return;
     }
 
     bool reported = false;
-    if (completed && global_state.config.gpu_detailed_profiling) {
+    if (completed && global_state.config.gpu_detailed_profiling && is_profiled(scopinst)) {
         assert(has_event_completed(scopinst, event));
         report_finished_event(scopinst, event, mem, kernel);
         reported = true;
     }
 
-    if (need_store_events()) {
+    if (progress_thread_enabled()) {
+        progress_submit(scopinst, event, mem, kernel, reported);
+    } else if (need_store_events(scopinst)) {
         scopinst->event_size += 1;
         scopinst->pending_events = realloc_checked(scopinst, scopinst->pending_events, scopinst->event_size * sizeof *scopinst->pending_events);
         struct prl_pending_event *pende = &scopinst->pending_events[scopinst->event_size - 1];
@@ -1766,6 +3103,84 @@ static void bench_push_back(struct prl_stat *elmt) {
     global_state.bench_stats_size = new_size;
 }
 
+static void lru_remove(prl_mem mem) {
+    assert(mem->dev_resident);
+
+    if (mem->lru_prev)
+        mem->lru_prev->lru_next = mem->lru_next;
+    else
+        global_state.lru_first = mem->lru_next;
+    if (mem->lru_next)
+        mem->lru_next->lru_prev = mem->lru_prev;
+    else
+        global_state.lru_last = mem->lru_prev;
+    mem->lru_prev = NULL;
+    mem->lru_next = NULL;
+    mem->dev_resident = false;
+    global_state.dev_resident_bytes -= mem->dev_resident_size;
+    mem->dev_resident_size = 0;
+}
+
+static void lru_push_front(prl_mem mem) {
+    assert(!mem->dev_resident);
+
+    mem->lru_prev = NULL;
+    mem->lru_next = global_state.lru_first;
+    if (global_state.lru_first)
+        global_state.lru_first->lru_prev = mem;
+    else
+        global_state.lru_last = mem;
+    global_state.lru_first = mem;
+    mem->dev_resident = true;
+    mem->dev_resident_size = mem->size;
+    global_state.dev_resident_bytes += mem->dev_resident_size;
+}
+
+static struct prl_dedup_entry *dedup_find(cl_mem clmem) {
+    for (int i = 0; i < DEDUP_CACHE_ENTRIES; i += 1) {
+        struct prl_dedup_entry *entry = &global_state.dedup_cache[i];
+        if (entry->clmem && entry->clmem == clmem)
+            return entry;
+    }
+    return NULL;
+}
+
+// The mem does not use its dedup cache buffer anymore
+static void dedup_drop_user(prl_mem mem) {
+    assert(mem->dev_shared);
+    struct prl_dedup_entry *entry = dedup_find(mem->clmem);
+    assert(entry && entry->users > 0);
+    entry->users -= 1;
+}
+
+static void dedup_entry_release(prl_scop_instance scopinst, struct prl_dedup_entry *entry) {
+    assert(entry->clmem && entry->users == 0);
+    if (entry->ready)
+        clReleaseEvent_checked(scopinst, entry->ready);
+    clReleaseMemObject_checked(scopinst, entry->clmem);
+    global_state.dev_resident_bytes -= entry->size;
+    memset(entry, 0, sizeof *entry);
+}
+
+// Least recently used cache entry that no mem uses; NULL if there is none
+static struct prl_dedup_entry *dedup_lru_unused() {
+    struct prl_dedup_entry *victim = NULL;
+    for (int i = 0; i < DEDUP_CACHE_ENTRIES; i += 1) {
+        struct prl_dedup_entry *entry = &global_state.dedup_cache[i];
+        if (entry->clmem && entry->users == 0 && (!victim || entry->last_use < victim->last_use))
+            victim = entry;
+    }
+    return victim;
+}
+
+// Mark as most recently used
+static void lru_touch(prl_mem mem) {
+    if (!mem->dev_resident || global_state.lru_first == mem)
+        return;
+    lru_remove(mem);
+    lru_push_front(mem);
+}
+
 static void memlist_push_front(prl_mem *first, prl_mem item) {
     assert(first);
 
@@ -1776,12 +3191,405 @@ static void memlist_push_front(prl_mem *first, prl_mem item) {
     *first = item;
 }
 
+// Gaps of clean pages up to this size between dirty pages are uploaded as well to get fewer transfers
+#define DIRTY_MERGE_GAP_PAGES 2
+
+#ifdef PRL_HAVE_MPROTECT
+static struct sigaction prev_segv_action;
+#ifdef __APPLE__
+static struct sigaction prev_bus_action;
+#endif
+static bool fault_handler_installed = false;
+
+// Protected host pages of a mem, as seen by the fault handler. The handler cannot use global_mems since it might be changed while a page faults; nodes are only prepended to fault_ranges and reused, but not freed while the handler is installed.
+// The other fields are set before begin is published.
+struct prl_fault_range {
+    char *begin; // Atomic; NULL if the node is unused
+    char *end;
+    unsigned char *dirty_pages;
+    volatile sig_atomic_t lazy;    // Access-protected (PRL_LAZY_READBACK)
+    volatile sig_atomic_t written; // A page has been made writable; mem->loc is updated by host_faults_apply
+    struct prl_fault_range *next;
+};
+static struct prl_fault_range *fault_ranges; // Atomic
+static size_t host_write_faults;             // Atomic; added to counter_host_write_faults by host_faults_fold
+#endif
+
+static size_t mem_page_count(prl_mem mem) {
+    assert(global_state.page_size > 0);
+    return (mem->size + global_state.page_size - 1) / global_state.page_size;
+}
+
+static bool host_paging_enabled() {
+    return global_state.config.dirty_tracking || global_state.config.lazy_readback;
+}
+
+// Allocate host memory whose pages can be protected individually
+static void host_alloc_paged(prl_scop_instance scopinst, prl_mem mem) {
+    assert(mem);
+    assert(!mem->host_mem);
+    assert(mem->size > 0);
+
+    size_t pages = mem_page_count(mem);
+    void *ptr = NULL;
+    prl_time_t start = timestamp();
+    int err = posix_memalign(&ptr, global_state.page_size, pages * global_state.page_size);
+    prl_time_t stop = timestamp();
+    add_time(scopinst, stat_cpu_malloc, stop - start);
+    assert(!err && ptr);
+
+    mem->host_mem = ptr;
+    mem->host_paged = true;
+    mem->dirty_pages = malloc_checked(scopinst, pages);
+    memset(mem->dirty_pages, 0, pages);
+}
+
+#ifdef PRL_HAVE_MPROTECT
+static void host_mprotect(prl_mem mem, int prot) {
+    int err = mprotect(mem->host_mem, mem_page_count(mem) * global_state.page_size, prot);
+    assert(!err);
+}
+#endif
+
+#ifdef PRL_HAVE_MPROTECT
+// Make the mem's protected pages known to the fault handler
+static void fault_range_acquire(prl_mem mem, bool lazy) {
+    struct prl_fault_range *range = mem->fault_range;
+    if (range) {
+        range->lazy = lazy;
+        return;
+    }
+
+    for (range = fault_ranges; range; range = range->next) {
+        if (!range->begin)
+            break;
+    }
+    if (!range) {
+        range = malloc_checked(NOSCOPINST, sizeof *range);
+        memset(range, 0, sizeof *range);
+        range->next = fault_ranges;
+        __atomic_store_n(&fault_ranges, range, __ATOMIC_RELEASE);
+    }
+
+    range->end = (char *)mem->host_mem + mem_page_count(mem) * global_state.page_size;
+    range->dirty_pages = mem->dirty_pages;
+    range->lazy = lazy;
+    range->written = 0;
+    __atomic_store_n(&range->begin, (char *)mem->host_mem, __ATOMIC_RELEASE);
+    mem->fault_range = range;
+}
+
+static void fault_range_release(prl_mem mem) {
+    if (!mem->fault_range)
+        return;
+    __atomic_store_n(&mem->fault_range->begin, NULL, __ATOMIC_RELEASE);
+    mem->fault_range = NULL;
+}
+#endif
+
+// A host write recorded by the fault handler makes the device copy outdated
+static void host_faults_apply(prl_mem mem) {
+#ifdef PRL_HAVE_MPROTECT
+    struct prl_fault_range *range = mem->fault_range;
+    if (!range || !range->written)
+        return;
+
+    range->written = 0;
+    if (mem->loc == loc_shared)
+        mem->loc = loc_host;
+#endif
+}
+
+// Add the write faults counted by the fault handler to the statistics
+static void host_faults_fold() {
+#ifdef PRL_HAVE_MPROTECT
+    size_t faults = __atomic_exchange_n(&host_write_faults, 0, __ATOMIC_RELAXED);
+    if (faults)
+        add_counter(NOSCOPINST, counter_host_write_faults, faults);
+#endif
+}
+
+// Also makes the host buffer of a lazy mem accessible without reading it back; only use if its content is not needed
+static void host_unprotect(prl_mem mem) {
+#ifdef PRL_HAVE_MPROTECT
+    if (!mem->host_protected)
+        return;
+
+    // Pages stay known to the fault handler until they cannot fault anymore
+    host_mprotect(mem, PROT_READ | PROT_WRITE);
+    host_faults_apply(mem);
+    fault_range_release(mem);
+    mem->host_protected = false;
+    mem->host_lazy = false;
+#endif
+}
+
+static void host_protect_noaccess(prl_mem mem) {
+#ifdef PRL_HAVE_MPROTECT
+    assert(mem->host_paged);
+    fault_range_acquire(mem, true);
+    host_mprotect(mem, PROT_NONE);
+    mem->host_protected = true;
+    mem->host_lazy = true;
+#endif
+}
+
+// Host and device buffer are equal now; record host writes from here on.
+static void dirty_rebase(prl_mem mem) {
+    if (!mem->host_paged || !global_state.config.dirty_tracking)
+        return;
+
+    memset(mem->dirty_pages, 0, mem_page_count(mem));
+    mem->dirty_baseline = true;
+    if (mem->host_lazy)
+        return; // Not accessible at all; host_materialize rebases again
+#ifdef PRL_HAVE_MPROTECT
+    // host_write_fault makes written pages writable individually; host_protected remains set, so protect all pages again
+    fault_range_acquire(mem, false);
+    mem->fault_range->written = 0; // The pages written so far are part of the new baseline
+    host_mprotect(mem, PROT_READ);
+    mem->host_protected = true;
+#endif
+}
+
+// The device buffer may diverge from the host buffer by other means than host writes; upload everything next time.
+static void dirty_invalidate(prl_mem mem) {
+    if (!mem->host_paged)
+        return;
+
+    mem->dirty_baseline = false;
+    if (!mem->host_lazy)
+        host_unprotect(mem);
+}
+
+// Whether the device copy can be kept current outside of SCoPs, i.e. we get to know when the host modifies its buffer
+static bool host_writes_tracked(prl_mem mem) {
+    return !mem->host_writable || (mem->dirty_baseline && mem->host_protected);
+}
+
+// Location after a transfer to the host has completed
+static enum prl_alloc_current_location loc_after_readback(prl_mem mem) {
+    assert(mem->type == alloc_type_rwbuf);
+    return host_writes_tracked(mem) ? loc_shared : loc_host;
+}
+
+static void mem_dev_changed(prl_mem mem) {
+    global_state.dev_version_clock += 1;
+    mem->dev_version = global_state.dev_version_clock;
+}
+
+// The device buffer is going to be modified
+static void mem_dev_write(prl_mem mem) {
+    mem_dev_changed(mem);
+    switch (mem->loc) {
+    case loc_shared:
+        mem->loc = loc_dev;
+        break;
+    case loc_transferring_to_dev:
+        // Command queues are in-order; the kernel will run after the transfer, which must then not end in loc_shared
+        if (mem->type == alloc_type_rwbuf) {
+            mem->loc = loc_dev;
+            mem->transferevent = NULL;
+        }
+        break;
+    default:
+        break;
+    }
+    dirty_invalidate(mem);
+}
+
+static bool is_lazy_readback_applicable(prl_mem mem) {
+    return global_state.config.lazy_readback && mem->type == alloc_type_rwbuf && mem->host_paged && !mem->scopinst && mem->loc == loc_dev;
+}
+
+// Leave the data on the device until the host accesses it.
+static void defer_readback(prl_scop_instance scopinst, prl_mem mem) {
+    assert(is_lazy_readback_applicable(mem));
+
+    if (mem->host_lazy)
+        return;
+
+    mem->dirty_baseline = false;
+    host_protect_noaccess(mem);
+    add_counter(scopinst, counter_bytes_deferred, mem->size);
+}
+
+// A queue for blocking commands, also outside of SCoPs; pass to release_blocking_queue when done
+static cl_command_queue acquire_blocking_queue(prl_scop_instance scopinst) {
+    if (scopinst)
+        return scopinst->queue;
+    if (global_state.queue)
+        return global_state.queue;
+    return clCreateCommandQueue_checked(scopinst, global_state.context, global_state.device, 0);
+}
+
+static void release_blocking_queue(prl_scop_instance scopinst, cl_command_queue queue) {
+    if (queue != global_state.queue && (!scopinst || queue != scopinst->queue))
+        clReleaseCommandQueue_checked(scopinst, queue);
+}
+
+// Read back the buffer of a lazy mem; called when the host requests access to it (prl_mem_get_host_mem) and before PRL gives up the device copy.
+static void host_materialize(prl_scop_instance scopinst, prl_mem mem) {
+    assert(mem->host_lazy);
+
+    host_unprotect(mem);
+    if (mem->loc & loc_bit_dev_is_current) {
+        cl_command_queue queue = acquire_blocking_queue(scopinst);
+        clEnqueueReadBuffer_checked(scopinst, queue, mem->clmem, CL_BLOCKING_TRUE, 0, mem->size, mem->host_mem, 0, NULL, NULL);
+        count_transfer(scopinst, mem, dir_to_host, mem->size);
+        add_counter(scopinst, counter_lazy_readbacks, 1);
+        release_blocking_queue(scopinst, queue);
+
+        dirty_rebase(mem);
+        mem->loc = loc_after_readback(mem);
+    } else {
+        dirty_rebase(mem);
+    }
+}
+
+#ifdef PRL_HAVE_MPROTECT
+// Called from the signal handler; must only do async-signal-safe work. The fault might be raised within libc or the OpenCL driver, with any of their locks held, and PRL's state might be in the middle of an update.
+// Only records the write in the page bitmap and unprotects the page; accesses to lazily read-back mems are reported and not handled.
+static bool host_write_fault(void *addr) {
+    char *ptr = addr;
+    size_t page_size = global_state.page_size;
+
+    for (struct prl_fault_range *range = __atomic_load_n(&fault_ranges, __ATOMIC_ACQUIRE); range; range = range->next) {
+        char *begin = __atomic_load_n(&range->begin, __ATOMIC_ACQUIRE);
+        if (!begin || ptr < begin || range->end <= ptr)
+            continue;
+
+        if (range->lazy) {
+            // Reading back requires OpenCL calls; the host must have requested access using prl_mem_get_host_mem
+            static const char msg[] = "PRL: Host access to a buffer that has not been read back (PRL_LAZY_READBACK); use prl_mem_get_host_mem before accessing it\n";
+            ssize_t written = write(STDERR_FILENO, msg, sizeof msg - 1);
+            (void)written;
+            return false;
+        }
+
+        size_t page = (ptr - begin) / page_size;
+        range->dirty_pages[page] = 1;
+        range->written = 1;
+        __atomic_fetch_add(&host_write_faults, 1, __ATOMIC_RELAXED);
+        return mprotect(begin + page * page_size, page_size, PROT_READ | PROT_WRITE) == 0;
+    }
+
+    return false;
+}
+
+static void host_fault_handler(int sig, siginfo_t *info, void *context) {
+    if (host_write_fault(info->si_addr))
+        return;
+
+    // Not caused by PRL's page protection; forward to the handler that was installed before
+    struct sigaction *prev = &prev_segv_action;
+#ifdef __APPLE__
+    if (sig == SIGBUS)
+        prev = &prev_bus_action;
+#endif
+    if (prev->sa_flags & SA_SIGINFO) {
+        (*prev->sa_sigaction)(sig, info, context);
+    } else if (prev->sa_handler != SIG_DFL && prev->sa_handler != SIG_IGN) {
+        (*prev->sa_handler)(sig);
+    } else {
+        // Executing the faulting instruction again will trigger the default action
+        sigaction(sig, prev, NULL);
+    }
+}
+#endif
+
+static void install_fault_handler() {
+#ifdef PRL_HAVE_MPROTECT
+    if (fault_handler_installed)
+        return;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_sigaction = host_fault_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+
+    int err = sigaction(SIGSEGV, &action, &prev_segv_action);
+    assert(!err);
+#ifdef __APPLE__
+    // Darwin reports accesses to protected pages as SIGBUS
+    err = sigaction(SIGBUS, &action, &prev_bus_action);
+    assert(!err);
+#endif
+    fault_handler_installed = true;
+#endif
+}
+
+static void uninstall_fault_handler() {
+#ifdef PRL_HAVE_MPROTECT
+    if (!fault_handler_installed)
+        return;
+
+    sigaction(SIGSEGV, &prev_segv_action, NULL);
+#ifdef __APPLE__
+    sigaction(SIGBUS, &prev_bus_action, NULL);
+#endif
+    fault_handler_installed = false;
+
+    struct prl_fault_range *range = fault_ranges;
+    while (range) {
+        struct prl_fault_range *next = range->next;
+        free_checked(NOSCOPINST, range);
+        range = next;
+    }
+    fault_ranges = NULL;
+#endif
+}
+
+// Set by the SIGUSR1 handler (PRL_DUMP_SIGNAL); the dump itself is done by poll_window_dump outside of the signal handler since printing is not async-signal-safe and the statistics might be in the middle of an update
+#ifdef PRL_HAVE_SIGUSR1
+static volatile sig_atomic_t dump_requested = 0;
+static struct sigaction prev_usr1_action;
+static bool dump_signal_installed = false;
+
+static void dump_signal_handler(int sig) {
+    (void)sig;
+    dump_requested = 1;
+}
+#endif
+
+static void install_dump_signal() {
+#ifdef PRL_HAVE_SIGUSR1
+    if (dump_signal_installed)
+        return;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = dump_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    int err = sigaction(SIGUSR1, &action, &prev_usr1_action);
+    assert(!err);
+    dump_signal_installed = true;
+#else
+    fputs("PRL_DUMP_SIGNAL is not supported on this platform\n", stderr);
+#endif
+}
+
+static void uninstall_dump_signal() {
+#ifdef PRL_HAVE_SIGUSR1
+    if (!dump_signal_installed)
+        return;
+
+    sigaction(SIGUSR1, &prev_usr1_action, NULL);
+    dump_signal_installed = false;
+    dump_requested = 0;
+#endif
+}
+
 //TODO: It is not necessary to know size at creation-time
 static prl_mem prl_mem_create_empty(size_t size, const char *name, prl_scop_instance scopinst) {
     assert(prl_initialized);
 
     prl_mem result = malloc_checked(scopinst, sizeof *result);
     memset(result, 0, sizeof *result);
+    mem_dev_changed(result);
 
     result->size = size;
     result->tag = false;
@@ -1794,6 +3602,7 @@ static prl_mem prl_mem_create_empty(size_t size, const char *name, prl_scop_inst
         // Global/user-managed memory
         // Responsibility to free is at user's
         memlist_push_front(&global_state.global_mems, result);
+        global_state.global_mems_gen += 1;
     } else {
         // Local to SCoP instance
         // prl_scop_leave will free this
@@ -2156,6 +3965,35 @@ static bool get_bool(const char *str) {
     return res;
 }
 
+// Number of bytes, optionally with a K, M or G suffix (multiples of 1024)
+static cl_ulong get_size(const char *str) {
+    assert(str);
+    char *end = NULL;
+    unsigned long long res = strtoull(str, &end, 10);
+    if (end && *end != '\0') {
+        switch (*end) {
+        case 'g':
+        case 'G':
+            res *= 1024;
+            // fallthrough
+        case 'm':
+        case 'M':
+            res *= 1024;
+            // fallthrough
+        case 'k':
+        case 'K':
+            res *= 1024;
+            end += 1;
+            break;
+        }
+    }
+    if (end == str || !end || *end != '\0') {
+        fprintf(stderr, "Could not parse size: %s\n", str);
+        exit(1);
+    }
+    return res;
+}
+
 static int get_int(const char *str) {
     assert(str);
     char *end = NULL;
@@ -2281,6 +4119,45 @@ static void env_config(struct prl_global_config *config) {
         config->gpu_detailed_profiling = trace;
         config->cpu_detailed_profiling = trace;
     }
+    if ((str = getenv(PRL_ADVISE))) {
+        bool advise = get_bool(str);
+        config->advise = advise;
+        config->cpu_profiling |= advise;
+        config->gpu_profiling |= advise;
+    }
+    if ((str = getenv(PRL_DUMP_INTERVAL))) {
+        config->dump_interval = atof(str);
+        assert(config->dump_interval >= 0);
+        config->cpu_profiling |= config->dump_interval > 0;
+        config->gpu_profiling |= config->dump_interval > 0;
+    }
+    if ((str = getenv(PRL_DUMP_SIGNAL))) {
+        bool dump = get_bool(str);
+        config->dump_signal = dump;
+        config->cpu_profiling |= dump;
+        config->gpu_profiling |= dump;
+    }
+#ifdef PRL_NO_PROFILING
+    if (config->cpu_profiling || config->gpu_profiling || config->cpu_detailed_profiling || config->gpu_detailed_profiling)
+        fputs("Profiling and tracing are not available in this build of the runtime\n", stderr);
+    config->cpu_profiling = false;
+    config->gpu_profiling = false;
+    config->cpu_detailed_profiling = false;
+    config->gpu_detailed_profiling = false;
+    config->advise = false;
+    config->dump_interval = 0;
+    config->dump_signal = false;
+#endif
+
+    if ((str = getenv(PRL_PROF_SAMPLE))) {
+        if (strchr(str, '.')) {
+            config->prof_sample_fraction = atof(str);
+            assert(0 < config->prof_sample_fraction && config->prof_sample_fraction <= 1);
+        } else {
+            config->prof_sample = get_int(str);
+            assert(config->prof_sample >= 0);
+        }
+    }
 
     if ((prefix = getenv(PRL_PROFILING_PREFIX))) {
         config->profiling_prefix = prefix;
@@ -2298,6 +4175,60 @@ static void env_config(struct prl_global_config *config) {
         assert(config->timing_runs >= 1);
     }
 
+    if ((str = getenv(PRL_DIRTY_TRACKING))) {
+        config->dirty_tracking = get_bool(str);
+#ifndef PRL_HAVE_MPROTECT
+        if (config->dirty_tracking)
+            fputs("PRL_DIRTY_TRACKING is not supported on this platform\n", stderr);
+        config->dirty_tracking = false;
+#endif
+    }
+    if ((str = getenv(PRL_SCOP_REPLAY))) {
+        config->scop_replay = get_bool(str);
+    }
+    if ((str = getenv(PRL_CLOCK))) {
+        if (!strcmp(str, "tsc")) {
+            config->clock = prl_clock_tsc;
+        } else if (!strcmp(str, "monotonic")) {
+            config->clock = prl_clock_monotonic;
+        } else if (!strcmp(str, "monotonic_raw")) {
+            config->clock = prl_clock_monotonic_raw;
+        } else {
+            fputs("cannot read env PRL_CLOCK\n", stderr);
+            exit(1);
+        }
+    }
+    if ((str = getenv(PRL_MEMO_CACHE))) {
+        config->memo_cache = get_int(str);
+        assert(config->memo_cache >= 0);
+    }
+    if ((str = getenv(PRL_DEDUP_UPLOADS))) {
+        config->dedup_uploads = get_bool(str);
+    }
+    if ((str = getenv(PRL_LAUNCH_SLICES))) {
+        config->launch_slices = get_int(str);
+        assert(config->launch_slices >= 0);
+    }
+    if ((str = getenv(PRL_DEVICE_MEMORY_BUDGET))) {
+        config->device_memory_budget = get_size(str);
+    }
+    if ((str = getenv(PRL_PROGRESS_THREAD))) {
+        config->progress_thread = get_bool(str);
+#ifndef PRL_HAVE_PTHREADS
+        if (config->progress_thread)
+            fputs("PRL_PROGRESS_THREAD is not supported on this platform\n", stderr);
+        config->progress_thread = false;
+#endif
+    }
+    if ((str = getenv(PRL_LAZY_READBACK))) {
+        config->lazy_readback = get_bool(str);
+#ifndef PRL_HAVE_MPROTECT
+        if (config->lazy_readback)
+            fputs("PRL_LAZY_READBACK is not supported on this platform\n", stderr);
+        config->lazy_readback = false;
+#endif
+    }
+
 	if ((str = getenv(PRL_COMMAND_QUEUE))) {
 		if (strcasecmp(str, "global")==0) {
 			config->global_command_queue = true;
@@ -2333,7 +4264,8 @@ static void print_stat_entry(const char *name, const int *count, double duration
     }
 }
 
-static void print_stat(double durations[static const restrict STAT_ENTRIES], int counts[const restrict STAT_ENTRIES], double relstddevs[const restrict STAT_ENTRIES], const char *prefix) {
+// With window, durations are those since the previous prl_perf_dump_window
+static void print_stat(double durations[static const restrict STAT_ENTRIES], int counts[const restrict STAT_ENTRIES], double relstddevs[const restrict STAT_ENTRIES], bool window, const char *prefix) {
     assert(durations);
 
     //puts("===============================================================================");
@@ -2347,14 +4279,192 @@ static void print_stat(double durations[static const restrict STAT_ENTRIES], int
     if (global_state.config.cpu_profiling && global_state.config.gpu_profiling)
         puts("");
     if (global_state.config.gpu_profiling) {
-        puts("                           GPU accumulated wall clock");
+        uint64_t sample_instances = global_state.sample_instances;
+        uint64_t sample_profiled = global_state.sample_profiled;
+        if (window) {
+            sample_instances -= global_state.window_sample_instances;
+            sample_profiled -= global_state.window_sample_profiled;
+        }
+        if (sample_profiled < sample_instances && !global_state.config.gpu_detailed_profiling)
+            printf("                           GPU accumulated wall clock (%" PRIu64 " of %" PRIu64 " SCoP instances profiled, extrapolated)\n", sample_profiled, sample_instances);
+        else
+            puts("                           GPU accumulated wall clock");
         for (int i = STAT_GPU_FIRST; i <= STAT_GPU_LAST; i += 1) {
-            print_stat_entry(statname[i], counts ? &counts[i] : NULL, durations[i], relstddevs ? &relstddevs[i] : NULL, prefix);
+            print_stat_entry(statname[i], counts ? &counts[i] : NULL, durations[i] * sample_scale_since(i, window), relstddevs ? &relstddevs[i] : NULL, prefix);
         }
     }
     //puts("===============================================================================");
 }
 
+static void print_counters(const uint64_t counters[static const restrict COUNTER_ENTRIES], const char *prefix) {
+    assert(counters);
+    if (!prefix)
+        prefix = "";
+
+    bool any = false;
+    for (int i = 0; i < COUNTER_ENTRIES; i += 1)
+        any |= counters[i] != 0;
+    if (!any)
+        return;
+
+    puts("                           Transfer volume and events");
+    for (int i = 0; i < COUNTER_ENTRIES; i += 1) {
+        if (!counters[i])
+            continue;
+        printf("%s%-25s:%12" PRIu64 " %s\n", prefix, countername[i], counters[i], counterunit[i]);
+    }
+}
+
+static void print_latency_buckets(const char *name, const uint64_t buckets[static const restrict LATENCY_BUCKETS], const char *prefix) {
+    printf("%s  %-23s:", prefix, name);
+    for (int i = 0; i < LATENCY_BUCKETS; i += 1) {
+        if (!buckets[i])
+            continue;
+        bool last = i == LATENCY_BUCKETS - 1;
+        double bound = (double)((uint64_t)1 << (last ? i : i + 1));
+        const char *rel = last ? ">=" : "<";
+        if (bound < 1000)
+            printf(" %s%.0fns:%" PRIu64, rel, bound, buckets[i]);
+        else if (bound < 1000000)
+            printf(" %s%.0fus:%" PRIu64, rel, bound * 0.001, buckets[i]);
+        else
+            printf(" %s%.0fms:%" PRIu64, rel, bound * 0.000001, buckets[i]);
+    }
+    puts("");
+}
+
+static void print_latency_hist(const char *name, const struct prl_latency_hist *hist, const char *prefix) {
+    if (!hist->count)
+        return;
+    if (!prefix)
+        prefix = "";
+
+    printf("%s%-25s:%8" PRIu64 " cmds, mean %9.3fus queued->submit, %9.3fus submit->start\n", prefix, name, hist->count, hist->queue_total * 0.001 / hist->count, hist->submit_total * 0.001 / hist->count);
+    print_latency_buckets("queued->submit", hist->queue, prefix);
+    print_latency_buckets("submit->start", hist->submit, prefix);
+}
+
+static void print_latencies(const char *prefix) {
+    bool any = false;
+    for (int i = STAT_GPU_FIRST; i <= STAT_GPU_LAST; i += 1)
+        any |= global_state.latency[i].count != 0;
+    if (!any)
+        return;
+
+    puts("                           Launch latency");
+    for (int i = STAT_GPU_FIRST; i <= STAT_GPU_LAST; i += 1)
+        print_latency_hist(statname[i], &global_state.latency[i], prefix);
+}
+
+#define TOP_SCOPS 10
+
+static double scop_gpu_scale(prl_scop scop) {
+    if (scop->profiled_instances == 0)
+        return 1;
+    return (double)scop->instances / scop->profiled_instances;
+}
+
+// What to optimize first: CPU time in the SCoP if measured, GPU working time otherwise
+static double scop_cost(prl_scop scop) {
+    if (global_state.config.cpu_profiling)
+        return scop->stat.entries[stat_cpu_scop];
+    return scop->stat.entries[stat_gpu_working] * scop_gpu_scale(scop);
+}
+
+static int cmp_scop_cost(const void *lhs_arg, const void *rhs_arg) {
+    double lhs = scop_cost(*(const prl_scop *)lhs_arg);
+    double rhs = scop_cost(*(const prl_scop *)rhs_arg);
+    return (lhs < rhs) - (lhs > rhs);
+}
+
+static void print_top_scops(const char *prefix) {
+    if (!prefix)
+        prefix = "";
+
+    size_t n = 0;
+    for (prl_scop scop = global_state.scops; scop; scop = scop->next) {
+        if (scop->instances > 0)
+            n += 1;
+    }
+    if (n == 0)
+        return;
+
+    prl_scop *scops = malloc_checked(NOSCOPINST, n * sizeof *scops);
+    size_t i = 0;
+    for (prl_scop scop = global_state.scops; scop; scop = scop->next) {
+        if (scop->instances > 0)
+            scops[i++] = scop;
+    }
+    qsort(scops, n, sizeof *scops, &cmp_scop_cost);
+
+    puts("                           SCoPs by cost");
+    for (i = 0; i < n && i < TOP_SCOPS; i += 1) {
+        prl_scop scop = scops[i];
+        struct prl_stat *stat = &scop->stat;
+        double scale = scop_gpu_scale(scop);
+
+        char unnamed[32];
+        const char *name = scop->name;
+        if (!name) {
+            snprintf(unnamed, sizeof unnamed, "scop@%p", (void *)scop);
+            name = unnamed;
+        }
+
+        printf("%s%-25s:%6d instances", prefix, name, scop->instances);
+        if (global_state.config.cpu_profiling)
+            printf(", cpu %8.3fms", stat->entries[stat_cpu_scop] * 0.000001);
+        if (global_state.config.gpu_profiling)
+            printf(", gpu working %8.3fms, idle %8.3fms, kernels %8.3fms", stat->entries[stat_gpu_working] * scale * 0.000001, stat->entries[stat_gpu_idle] * scale * 0.000001, stat->entries[stat_gpu_compute] * scale * 0.000001);
+        printf(", %" PRIu64 " bytes host->dev, %" PRIu64 " bytes dev->host\n", stat->counters[counter_bytes_to_device], stat->counters[counter_bytes_to_host]);
+    }
+    free_checked(NOSCOPINST, scops);
+}
+
+#define TOP_BUFFERS 10
+
+static uint64_t buffer_traffic(const struct prl_buffer_stat *stat) {
+    return stat->bytes[dir_to_device] + stat->bytes[dir_to_host];
+}
+
+static int cmp_buffer_traffic(const void *lhs_arg, const void *rhs_arg) {
+    uint64_t lhs = buffer_traffic(*(struct prl_buffer_stat *const *)lhs_arg);
+    uint64_t rhs = buffer_traffic(*(struct prl_buffer_stat *const *)rhs_arg);
+    return (lhs < rhs) - (lhs > rhs);
+}
+
+static void print_buffer_dir(const struct prl_buffer_stat *stat, enum transfer_dir dir, const char *dirstr) {
+    printf(", %s %12" PRIu64 " bytes in %4" PRIu64, dirstr, stat->bytes[dir], stat->transfers[dir]);
+    if (stat->duration[dir] > 0)
+        printf(" (%6.2f GB/s)", (double)stat->bytes[dir] / stat->duration[dir]);
+}
+
+static void print_top_buffers(const char *prefix) {
+    if (!prefix)
+        prefix = "";
+
+    size_t n = 0;
+    struct prl_buffer_stat **stats = malloc_checked(NOSCOPINST, global_state.buffer_stats_size * sizeof *stats);
+    for (size_t i = 0; i < global_state.buffer_stats_size; i += 1) {
+        if (buffer_traffic(global_state.buffer_stats[i]) > 0)
+            stats[n++] = global_state.buffer_stats[i];
+    }
+    if (n > 0) {
+        qsort(stats, n, sizeof *stats, &cmp_buffer_traffic);
+
+        puts("                           Buffers by traffic");
+        for (size_t i = 0; i < n && i < TOP_BUFFERS; i += 1) {
+            struct prl_buffer_stat *stat = stats[i];
+            printf("%s%-25s:", prefix, stat->name);
+            print_buffer_dir(stat, dir_to_device, "host->dev");
+            print_buffer_dir(stat, dir_to_host, "dev->host");
+            puts("");
+            if (stat->roundtrips_inside || stat->roundtrips_across)
+                printf("%s  ping-pong: copied back to the device %" PRIu64 " times within and %" PRIu64 " times across SCoP instances\n", prefix, stat->roundtrips_inside, stat->roundtrips_across);
+        }
+    }
+    free_checked(NOSCOPINST, stats);
+}
+
 #if 0
 static void dump_entry(const char *name, double median, double relstddev) {
 	if (global_state.config.bench_prefix)
@@ -2366,6 +4476,18 @@ static void dump_entry(const char *name, double median, double relstddev) {
 }
 #endif
 
+static void stat_diff(struct prl_stat *result, const struct prl_stat *now, const struct prl_stat *prev) {
+    for (int i = 0; i < STAT_ENTRIES; i += 1) {
+        result->entries[i] = now->entries[i] - prev->entries[i];
+        assert(result->entries[i] >= 0);
+        result->counts[i] = now->counts[i] - prev->counts[i];
+        assert(result->counts[i] >= 0);
+    }
+    for (int i = 0; i < COUNTER_ENTRIES; i += 1) {
+        result->counters[i] = now->counters[i] - prev->counters[i];
+    }
+}
+
 void prl_perf_dump() {
     size_t n = global_state.bench_stats_size;
     int intn = n;
@@ -2379,8 +4501,85 @@ void prl_perf_dump() {
     puts("");
     print_stat_entry("Duration", &intn, medians[stat_cpu_bench], &relstddevs[stat_cpu_bench], global_state.config.bench_prefix);
     puts("");
-    print_stat(medians, NULL, relstddevs, global_state.config.bench_prefix);
+    print_stat(medians, NULL, relstddevs, false, global_state.config.bench_prefix);
+    puts("");
+    print_top_scops(global_state.config.bench_prefix);
+    puts("");
+    print_top_buffers(global_state.config.bench_prefix);
+    puts("===============================================================================");
+}
+
+// Remember the current statistics as baseline of the next window
+static void window_restart(prl_time_t now) {
+    global_state.window_stat = global_state.global_stat;
+    global_state.window_sample_instances = global_state.sample_instances;
+    global_state.window_sample_profiled = global_state.sample_profiled;
+    for (prl_scop scop = global_state.scops; scop; scop = scop->next) {
+        memcpy(scop->window_entries, scop->stat.entries, sizeof scop->window_entries);
+        scop->window_instances = scop->instances;
+        scop->window_profiled_instances = scop->profiled_instances;
+    }
+    global_state.window_start = now;
+}
+
+void prl_perf_dump_window() {
+    prl_init();
+    host_faults_fold();
+
+    prl_time_t window_stop = timestamp_force();
+    struct prl_stat diff_stat;
+    stat_diff(&diff_stat, &global_state.global_stat, &global_state.window_stat);
+    double durations[STAT_ENTRIES];
+    for (int i = 0; i < STAT_ENTRIES; i += 1) {
+        durations[i] = diff_stat.entries[i]; // Type conversion to double
+    }
+
+    puts("===============================================================================");
+    printf("Profiling results of the last %.3fs\n", (window_stop - global_state.window_start) * 0.000000001);
+    puts("");
+    print_stat(durations, diff_stat.counts, NULL, true, global_state.config.profiling_prefix);
+    puts("");
+    print_counters(diff_stat.counters, global_state.config.profiling_prefix);
     puts("===============================================================================");
+    // The output is typically redirected to a file when running for a long time
+    fflush(stdout);
+
+    window_restart(window_stop);
+}
+
+// Dump requested by PRL_DUMP_INTERVAL or PRL_DUMP_SIGNAL; must be called where no statistics are being accumulated
+static void poll_window_dump() {
+#ifdef PRL_HAVE_SIGUSR1
+    if (dump_requested) {
+        dump_requested = 0;
+        prl_perf_dump_window();
+        return;
+    }
+#endif
+    if (global_state.config.dump_interval > 0 && timestamp_force() - global_state.window_start >= global_state.config.dump_interval * 1000000000.0)
+        prl_perf_dump_window();
+}
+
+static void memo_entry_clear(prl_scop_instance scopinst, struct prl_memo_entry *entry) {
+    free_checked(scopinst, entry->output_args);
+    free_checked(scopinst, entry->outputs);
+    free_checked(scopinst, entry->output_versions);
+    memset(entry, 0, sizeof *entry);
+}
+
+// The mem is about to be freed; drop launches that have it as output
+static void memo_forget(prl_mem mem) {
+    for (size_t i = 0; i < global_state.memo_size; i += 1) {
+        struct prl_memo_entry *entry = &global_state.memo[i];
+        if (!entry->valid)
+            continue;
+        for (size_t k = 0; k < entry->n_outputs; k += 1) {
+            if (entry->outputs[k] == mem) {
+                memo_entry_clear(NOSCOPINST, entry);
+                break;
+            }
+        }
+    }
 }
 
 static void mem_free(prl_scop_instance scopinst, prl_mem mem) {
@@ -2394,9 +4593,19 @@ static void mem_free(prl_scop_instance scopinst, prl_mem mem) {
     case alloc_type_dev_only:
     case alloc_type_rwbuf:
     case alloc_type_map: //TODO: Ensure that memory is unmapped?
+        host_unprotect(mem); // Content not needed anymore
         if (mem->host_mem && mem->host_owning)
             free_checked(scopinst, mem->host_mem);
         mem->host_mem = NULL;
+        free_checked(scopinst, mem->dirty_pages);
+        mem->dirty_pages = NULL;
+        mem->host_paged = false;
+        if (mem->dev_resident)
+            lru_remove(mem);
+        memo_forget(mem);
+        if (mem->dev_shared)
+            dedup_drop_user(mem);
+        mem->dev_shared = false;
         if (mem->clmem && mem->dev_owning)
             clReleaseMemObject_checked(scopinst, mem->clmem);
         mem->clmem = NULL;
@@ -2409,6 +4618,7 @@ static void mem_free(prl_scop_instance scopinst, prl_mem mem) {
 
     if (!mem->scopinst) {
         // Global mem, remove from list
+        global_state.global_mems_gen += 1;
         prl_mem prev = mem->mem_prev;
         prl_mem next = mem->mem_next;
 
@@ -2466,6 +4676,13 @@ static void callback_free_kernel_resources(prl_kernel kernel, void *user) {
         clReleaseKernel_checked(NOSCOPINST, kernel->kernel);
         kernel->kernel = NULL;
     }
+
+    for (size_t i = 0; i < kernel->args_cache_size; i += 1)
+        free_checked(NOSCOPINST, kernel->args_cache[i].data);
+    free_checked(NOSCOPINST, kernel->args_cache);
+    kernel->args_cache = NULL;
+    kernel->args_cache_size = 0;
+    kernel->args_gen += 1;
 }
 
 static void callback_free_kernel(prl_kernel kernel, void *user) {
@@ -2476,7 +4693,11 @@ static void callback_free_kernel(prl_kernel kernel, void *user) {
 }
 
 static void callback_kernel_print_stat(prl_kernel kernel, void *user) {
-    print_stat_entry(kernel->name, &kernel->total_count, kernel->total_duration, NULL, global_state.config.profiling_prefix);
+    print_stat_entry(kernel->name, &kernel->total_count, kernel->total_duration * kernel_gpu_scale(kernel), NULL, global_state.config.profiling_prefix);
+}
+
+static void callback_kernel_print_latency(prl_kernel kernel, void *user) {
+    print_latency_hist(kernel->name, &kernel->latency, global_state.config.profiling_prefix);
 }
 
 static void callback_free_program_resources(prl_program program, void *user) {
@@ -2495,6 +4716,271 @@ static void callback_free_program(prl_program program, void *user) {
     free_checked(NOSCOPINST, program);
 }
 
+static void free_scop_cmds(prl_scop_instance scopinst, prl_scop scop) {
+    for (size_t i = 0; i < scop->cmds_size; i += 1) {
+        struct prl_scop_cmd *cmd = &scop->cmds[i];
+        if (cmd->clmem)
+            clReleaseMemObject_checked(scopinst, cmd->clmem);
+        for (size_t j = 0; cmd->args && j < cmd->n_args; j += 1)
+            free_checked(scopinst, cmd->args[j].data);
+        free_checked(scopinst, cmd->args);
+    }
+    free_checked(scopinst, scop->cmds);
+    scop->cmds = NULL;
+    scop->cmds_size = 0;
+    scop->recorded = false;
+}
+
+#define ADVICE_LENGTH 320
+
+struct prl_advice {
+    double saving; // Estimated in nanoseconds; negative if unknown
+    char text[ADVICE_LENGTH];
+};
+
+struct prl_advisor {
+    size_t size;
+    struct prl_advice *advice;
+};
+
+static void advise(struct prl_advisor *advisor, double saving, const char *format, ...) {
+    advisor->size += 1;
+    advisor->advice = realloc_checked(NOSCOPINST, advisor->advice, advisor->size * sizeof *advisor->advice);
+    struct prl_advice *advice = &advisor->advice[advisor->size - 1];
+    advice->saving = saving;
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(advice->text, sizeof advice->text, format, args);
+    va_end(args);
+}
+
+static int cmp_advice(const void *lhs_arg, const void *rhs_arg) {
+    const struct prl_advice *lhs = lhs_arg;
+    const struct prl_advice *rhs = rhs_arg;
+    return (lhs->saving < rhs->saving) - (lhs->saving > rhs->saving);
+}
+
+static const char *scop_name(prl_scop scop, char *buf, size_t size) {
+    if (scop->name)
+        return scop->name;
+    snprintf(buf, size, "scop@%p", (void *)scop);
+    return buf;
+}
+
+static void callback_kernel_advise(prl_kernel kernel, void *user) {
+    struct prl_advisor *advisor = user;
+    if (!kernel->misaligned_launches || kernel->total_count == 0)
+        return;
+
+    // Lanes of the last SIMD group that are left unused
+    size_t multiple = kernel->preferred_wg_multiple;
+    size_t wg_size = kernel->misaligned_wg_size;
+    size_t padded = (wg_size + multiple - 1) / multiple * multiple;
+    double waste = 1 - (double)wg_size / padded;
+    double time = kernel->total_duration * kernel_gpu_scale(kernel) * kernel->misaligned_launches / kernel->launches;
+    advise(advisor, time * waste, "Kernel %s was launched %d times with a work-group size of %zu, which is not a multiple of its preferred work-group size multiple %zu; %.0f%% of the SIMD lanes are idle", kernel->name, kernel->misaligned_launches, wg_size, multiple, waste * 100);
+}
+
+// Analyse the collected statistics (PRL_ADVISE)
+static void print_advice() {
+    struct prl_advisor advisor = {0};
+    struct prl_stat *stat = &global_state.global_stat;
+
+    double working = stat->entries[stat_gpu_working] * sample_scale(stat_gpu_working);
+    double idle = stat->entries[stat_gpu_idle] * sample_scale(stat_gpu_idle);
+    if (idle > 0.05 * (working + idle))
+        advise(&advisor, idle, "The GPU was idle between the commands of a SCoP for %.0f%% of the time; use PRL_PROGRESS_THREAD=1 or prl_scop_leave_async to keep the device busy, and avoid host accesses to PRL buffers within SCoPs", 100 * idle / (working + idle));
+
+    if (global_state.config.blocking)
+        advise(&advisor, -1, "PRL_BLOCKING is enabled; every transfer and kernel launch waits for its completion, so the host and the device do not overlap");
+
+    for (prl_scop scop = global_state.scops; scop; scop = scop->next) {
+        double scop_scale = scop_gpu_scale(scop);
+        double transfer = (scop->stat.entries[stat_gpu_transfer_to_device] + scop->stat.entries[stat_gpu_transfer_to_host]) * scop_scale;
+        double compute = scop->stat.entries[stat_gpu_compute] * scop_scale;
+        if (transfer > compute && transfer > 0) {
+            char buf[32];
+            advise(&advisor, transfer, "SCoP %s spent %.3fms on transfers but only %.3fms on kernels; allocate its arrays with prl_alloc so that they stay on the device between instances", scop_name(scop, buf, sizeof buf), transfer * 0.000001, compute * 0.000001);
+        }
+    }
+
+    for (size_t i = 0; i < global_state.buffer_stats_size; i += 1) {
+        struct prl_buffer_stat *bstat = global_state.buffer_stats[i];
+
+        if (bstat->unchanged_uploads) {
+            double per_byte = bstat->bytes[dir_to_device] ? (double)bstat->duration[dir_to_device] / bstat->bytes[dir_to_device] : 0;
+            advise(&advisor, per_byte > 0 ? bstat->unchanged_bytes * per_byte : -1, "Buffer %s was uploaded %" PRIu64 " times (%" PRIu64 " bytes) with the same content as its previous upload; keep it on the device with prl_alloc or enable PRL_DEDUP_UPLOADS=1", bstat->name, bstat->unchanged_uploads, bstat->unchanged_bytes);
+        }
+
+        uint64_t roundtrips = bstat->roundtrips_inside + bstat->roundtrips_across;
+        if (roundtrips && bstat->transfers[dir_to_host]) {
+            // Assume every read-back followed by an upload was unnecessary
+            double readback = (double)bstat->duration[dir_to_host] * roundtrips / bstat->transfers[dir_to_host];
+            advise(&advisor, readback > 0 ? readback : -1, "Buffer %s was read back to the host and uploaded again %" PRIu64 " times; if the host does not use it in between, allocate it with prl_alloc and set PRL_LAZY_READBACK=1 so it is only read back when the host requests it with prl_mem_get_host_mem", bstat->name, roundtrips);
+        }
+    }
+
+    global_foreach_kernel(NULL, &callback_kernel_advise, &advisor);
+
+    for (size_t i = 0; i < global_state.builds_size; i += 1) {
+        struct prl_build_record *record = &global_state.builds[i];
+        if (record->builds > 1)
+            advise(&advisor, record->duration, "The same OpenCL program was built %d times; reuse the prl_program handle (prl_scop_program_from_str/file only builds if it is NULL)", record->builds);
+    }
+
+    puts("===============================================================================");
+    puts("Recommendations, by estimated saving");
+    if (advisor.size == 0)
+        puts("  None");
+    qsort(advisor.advice, advisor.size, sizeof *advisor.advice, &cmp_advice);
+    for (size_t i = 0; i < advisor.size; i += 1) {
+        struct prl_advice *advice = &advisor.advice[i];
+        if (advice->saving >= 0)
+            printf("%2zu. [%9.3fms] %s\n", i + 1, advice->saving * 0.000001, advice->text);
+        else
+            printf("%2zu. [  unknown  ] %s\n", i + 1, advice->text);
+    }
+    puts("===============================================================================");
+    free_checked(NOSCOPINST, advisor.advice);
+}
+
+// Upper bound of the bucket that contains the quantile
+static int64_t hist_quantile(const uint64_t buckets[static const restrict LATENCY_BUCKETS], double quantile) {
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i += 1)
+        total += buckets[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = ceil(quantile * total);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i += 1) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return (int64_t)1 << (i + 1);
+    }
+    return (int64_t)1 << LATENCY_BUCKETS;
+}
+
+static void poll_completions(bool wait);
+
+// The progress thread only accumulates into its instances; their statistics are merged on this thread when they complete
+void prl_perf_get_stats(struct prl_perf_snapshot *snapshot) {
+    assert(snapshot);
+    prl_init();
+    poll_completions(false);
+    host_faults_fold();
+
+    struct prl_stat *stat = &global_state.global_stat;
+    memset(snapshot, 0, sizeof *snapshot);
+
+    if (global_state.config.cpu_profiling)
+        snapshot->active = timestamp() - global_state.prl_start;
+    snapshot->cpu_scop = stat->entries[stat_cpu_scop];
+    snapshot->scop_instances = global_state.sample_instances;
+
+    snapshot->gpu_working = stat->entries[stat_gpu_working] * sample_scale(stat_gpu_working);
+    snapshot->gpu_idle = stat->entries[stat_gpu_idle] * sample_scale(stat_gpu_idle);
+    snapshot->gpu_transfer_to_device = stat->entries[stat_gpu_transfer_to_device] * sample_scale(stat_gpu_transfer_to_device);
+    snapshot->gpu_transfer_to_host = stat->entries[stat_gpu_transfer_to_host] * sample_scale(stat_gpu_transfer_to_host);
+    snapshot->gpu_compute = stat->entries[stat_gpu_compute] * sample_scale(stat_gpu_compute);
+
+    struct prl_latency_hist all = {0};
+    for (int i = STAT_GPU_FIRST; i <= STAT_GPU_LAST; i += 1) {
+        all.count += global_state.latency[i].count;
+        for (int j = 0; j < LATENCY_BUCKETS; j += 1) {
+            all.queue[j] += global_state.latency[i].queue[j];
+            all.submit[j] += global_state.latency[i].submit[j];
+        }
+    }
+    snapshot->commands = all.count;
+    snapshot->queue_latency_p50 = hist_quantile(all.queue, 0.5);
+    snapshot->queue_latency_p90 = hist_quantile(all.queue, 0.9);
+    snapshot->queue_latency_p99 = hist_quantile(all.queue, 0.99);
+    snapshot->submit_latency_p50 = hist_quantile(all.submit, 0.5);
+    snapshot->submit_latency_p90 = hist_quantile(all.submit, 0.9);
+    snapshot->submit_latency_p99 = hist_quantile(all.submit, 0.99);
+
+    snapshot->bytes_to_device = stat->counters[counter_bytes_to_device];
+    snapshot->bytes_to_host = stat->counters[counter_bytes_to_host];
+}
+
+struct perf_kernel_iter {
+    prl_perf_kernel_callback callback;
+    void *user;
+};
+
+static void callback_kernel_perf(prl_kernel kernel, void *user) {
+    struct perf_kernel_iter *iter = user;
+
+    struct prl_perf_kernel_stats stats = {
+        .name = kernel->name,
+        .launches = kernel->total_count,
+        .total_duration = kernel->total_duration * kernel_gpu_scale(kernel),
+        .duration_p50 = hist_quantile(kernel->duration_hist, 0.5),
+        .duration_p90 = hist_quantile(kernel->duration_hist, 0.9),
+        .duration_p99 = hist_quantile(kernel->duration_hist, 0.99),
+    };
+    if (kernel->latency.count) {
+        stats.queue_latency_mean = kernel->latency.queue_total / kernel->latency.count;
+        stats.submit_latency_mean = kernel->latency.submit_total / kernel->latency.count;
+    }
+    (*iter->callback)(&stats, iter->user);
+}
+
+void prl_perf_foreach_kernel(prl_perf_kernel_callback callback, void *user) {
+    assert(callback);
+    prl_init();
+    poll_completions(false);
+
+    struct perf_kernel_iter iter = {.callback = callback, .user = user};
+    global_foreach_kernel(NULL, &callback_kernel_perf, &iter);
+}
+
+void prl_perf_foreach_scop(prl_perf_scop_callback callback, void *user) {
+    assert(callback);
+    prl_init();
+    poll_completions(false);
+
+    for (prl_scop scop = global_state.scops; scop; scop = scop->next) {
+        struct prl_stat *stat = &scop->stat;
+        double scale = scop_gpu_scale(scop);
+        struct prl_perf_scop_stats stats = {
+            .name = scop->name,
+            .instances = scop->instances,
+            .cpu_time = stat->entries[stat_cpu_scop],
+            .gpu_working = stat->entries[stat_gpu_working] * scale,
+            .gpu_idle = stat->entries[stat_gpu_idle] * scale,
+            .gpu_transfer_to_device = stat->entries[stat_gpu_transfer_to_device] * scale,
+            .gpu_transfer_to_host = stat->entries[stat_gpu_transfer_to_host] * scale,
+            .gpu_compute = stat->entries[stat_gpu_compute] * scale,
+            .bytes_to_device = stat->counters[counter_bytes_to_device],
+            .bytes_to_host = stat->counters[counter_bytes_to_host],
+        };
+        (*callback)(&stats, user);
+    }
+}
+
+void prl_perf_foreach_entry(prl_perf_entry_callback callback, void *user) {
+    assert(callback);
+    prl_init();
+    poll_completions(false);
+    host_faults_fold();
+
+    struct prl_stat *stat = &global_state.global_stat;
+    for (int i = STAT_CPU_FIRST; i <= STAT_GPU_LAST; i += 1) {
+        double scale = (i >= STAT_GPU_FIRST) ? sample_scale(i) : 1;
+        (*callback)(statname[i], "ns", stat->entries[i] * scale, stat->counts[i], user);
+    }
+    for (int i = 0; i < COUNTER_ENTRIES; i += 1)
+        (*callback)(countername[i], counterunit[i], stat->counters[i], 0, user);
+}
+
+static void completion_finalize(prl_scop_completion completion);
+
 void prl_release() {
     if (!prl_initialized)
         return;
@@ -2504,15 +4990,27 @@ void prl_release() {
         puts("Shutting down PRL...");
     }
 
+    poll_completions(true);
+    if (progress_thread_enabled())
+        progress_shutdown();
+
     size_t nKernels = 0;
     struct prl_kerneltime *kerneltimes = NULL;
 
+    for (size_t i = 0; i < global_state.memo_size; i += 1)
+        memo_entry_clear(NOSCOPINST, &global_state.memo[i]);
+    free_checked(NOSCOPINST, global_state.memo);
+    global_state.memo = NULL;
+    global_state.memo_size = 0;
+
     global_foreach_kernel(&callback_free_program_resources, &callback_free_kernel_resources, NULL);
 
+    // prl_scop handles are stored by the caller and may be entered again after re-initialization; only drop what depends on the context
     prl_scop scop = global_state.scops;
     while (scop) {
         prl_scop nextscop = scop->next;
-        free_checked(NOSCOPINST, scop);
+        free_scop_cmds(NOSCOPINST, scop);
+        scop->rerecord = false;
         scop = nextscop;
     }
 
@@ -2521,6 +5019,15 @@ void prl_release() {
     while (gmem) {
         prl_mem nextmem = gmem->mem_next;
 
+        // Memory not freed by the user remains accessible
+        if (gmem->host_lazy && !gmem->tag)
+            host_materialize(NOSCOPINST, gmem);
+        gmem->dirty_baseline = false;
+        gmem->buffer_stat = NULL;
+        host_unprotect(gmem);
+        if (gmem->dev_resident)
+            lru_remove(gmem);
+
         // Non-tag global mems are to be freed by user
         if (gmem->tag) {
             mem_free(NOSCOPINST, gmem);
@@ -2534,6 +5041,7 @@ void prl_release() {
         fputs("\nMemory leak! Some PRL global memory has not been freed using prl_free or prl_mem_free\n", stderr);
     }
 #endif
+    host_faults_fold();
 
     if (dumping) {
         puts("===============================================================================");
@@ -2548,26 +5056,65 @@ void prl_release() {
             durations[i] = global_state.global_stat.entries[i]; // Type conversion to double
         }
         puts("");
-        print_stat(durations, global_state.global_stat.counts, NULL, global_state.config.profiling_prefix);
+        print_stat(durations, global_state.global_stat.counts, NULL, false, global_state.config.profiling_prefix);
+        puts("");
+        print_counters(global_state.global_stat.counters, global_state.config.profiling_prefix);
+        puts("");
+        print_top_scops(global_state.config.profiling_prefix);
+        puts("");
+        print_top_buffers(global_state.config.profiling_prefix);
         if (global_state.config.cpu_profiling) {
             puts("");
             global_foreach_kernel(NULL, &callback_kernel_print_stat, NULL);
         }
+        if (global_state.config.gpu_profiling) {
+            puts("");
+            print_latencies(global_state.config.profiling_prefix);
+            global_foreach_kernel(NULL, &callback_kernel_print_latency, NULL);
+        }
         puts("===============================================================================");
     }
+    if (global_state.config.advise)
+        print_advice();
 
 	// TODO: Nicer if these calls are behind the final dumping since tracing will print something here.
 	// Currently the kernel's name string is held by the OpenCL which would free it here.
     global_foreach_kernel(&callback_free_program, &callback_free_kernel, NULL);
 
+    for (size_t i = 0; i < global_state.buffer_stats_size; i += 1) {
+        free_checked(NOSCOPINST, global_state.buffer_stats[i]->name);
+        free_checked(NOSCOPINST, global_state.buffer_stats[i]);
+    }
+    free_checked(NOSCOPINST, global_state.buffer_stats);
+    global_state.buffer_stats = NULL;
+    global_state.buffer_stats_size = 0;
+    free_checked(NOSCOPINST, global_state.builds);
+    global_state.builds = NULL;
+    global_state.builds_size = 0;
+
 	if (global_state.queue) {
 		clReleaseCommandQueue_checked(NOSCOPINST, global_state.queue);
 		global_state.queue = NULL;
 	}
+    for (int i = 0; i < DEDUP_CACHE_ENTRIES; i += 1) {
+        struct prl_dedup_entry *entry = &global_state.dedup_cache[i];
+        if (entry->clmem) {
+            entry->users = 0; // Mems not freed by the user keep their own reference
+            dedup_entry_release(NOSCOPINST, entry);
+        }
+    }
+    for (int i = 0; i < STREAM_SLOTS; i += 1) {
+        if (global_state.stream_queues[i]) {
+            clReleaseCommandQueue_checked(NOSCOPINST, global_state.stream_queues[i]);
+            global_state.stream_queues[i] = NULL;
+        }
+    }
 	if (global_state.context) {
 		clReleaseContext_checked(NOSCOPINST, global_state.context);
 		global_state.context=NULL;
 	}
+    uninstall_fault_handler();
+    uninstall_dump_signal();
 
     prl_initialized = 0;
 }
@@ -2633,6 +5180,24 @@ void prl_init() {
 
     global_state.config = global_config;
     env_config(&global_state.config);
+    clock_init();
+    global_state.sample_random = timestamp_force() | 1;
+
+#ifdef PRL_HAVE_MPROTECT
+    global_state.page_size = sysconf(_SC_PAGESIZE);
+#endif
+    if (host_paging_enabled())
+        install_fault_handler();
+    if (progress_thread_enabled())
+        progress_start();
+    if (global_state.config.dump_signal)
+        install_dump_signal();
+
+    global_state.memo_size = global_state.config.memo_cache;
+    if (global_state.memo_size > 0) {
+        global_state.memo = malloc_checked(NOSCOPINST, global_state.memo_size * sizeof *global_state.memo);
+        memset(global_state.memo, 0, global_state.memo_size * sizeof *global_state.memo);
+    }
 
     bool dumping = global_state.config.dump_on_release;
     if (dumping) {
@@ -2646,9 +5211,16 @@ void prl_init() {
         if (global_state.config.gpu_profiling)
             fputs("GPU", stdout);
         puts("");
+        static const char *clockname[] = {
+            [prl_clock_monotonic_raw] = "monotonic_raw",
+            [prl_clock_monotonic] = "monotonic",
+            [prl_clock_tsc] = "tsc",
+        };
+        printf("Clock: %s (%.1f ns per timestamp)\n", clockname[global_state.clock], global_state.timestamp_cost);
     }
 
     global_state.prl_start = timestamp();
+    global_state.window_start = timestamp_force();
     enum prl_device_choice effective_device_choice = global_state.config.device_choice;
     int effective_platform = global_state.config.chosen_platform;
     int effective_device = global_state.config.chosen_device;
@@ -2744,6 +5316,8 @@ void prl_init() {
 
 	atexit(prl_release);
     global_state.context = clCreateContext_checked(NOSCOPINST, NULL, 1, &best_device, __ocl_report_error, NULL);
+    clGetDeviceInfo_checked(NOSCOPINST, best_device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof global_state.dev_global_mem_size, &global_state.dev_global_mem_size, NULL);
+    clGetDeviceInfo_checked(NOSCOPINST, best_device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof global_state.dev_max_alloc_size, &global_state.dev_max_alloc_size, NULL);
 	if (global_state.config.global_command_queue) {
 		global_state.queue = clCreateCommandQueue_checked(NOSCOPINST, global_state.context, global_state.device, any_gpu_profiling() ? CL_QUEUE_PROFILING_ENABLE : 0);
 	}
@@ -2755,16 +5329,140 @@ void prl_init() {
     prl_initialized = 1;
 }
 
-prl_scop_instance prl_scop_enter(prl_scop *scopref) {
+static struct prl_scop_cmd *record_cmd(prl_scop_instance scopinst, enum prl_scop_cmd_type type) {
+    assert(scopinst->replay == replay_recording);
+    prl_scop scop = scopinst->scop;
+
+    size_t old_size = scop->cmds_size;
+    size_t new_size = old_size + 1;
+    scop->cmds = realloc_checked(scopinst, scop->cmds, new_size * sizeof *scop->cmds);
+    scop->cmds_size = new_size;
+
+    struct prl_scop_cmd *cmd = &scop->cmds[old_size];
+    memset(cmd, 0, sizeof *cmd);
+    cmd->type = type;
+    return cmd;
+}
+
+static void replay_diverged(prl_scop_instance scopinst) {
+    assert(scopinst->replay == replay_replaying);
+
+    scopinst->replay = replay_off;
+    scopinst->scop->rerecord = true;
+    add_counter(scopinst, counter_replay_divergences, 1);
+}
+
+// Next recorded command if it has the expected type; otherwise replay ends for this instance
+static struct prl_scop_cmd *replay_cmd(prl_scop_instance scopinst, enum prl_scop_cmd_type type) {
+    assert(scopinst->replay == replay_replaying);
+    prl_scop scop = scopinst->scop;
+
+    if (scopinst->replay_pos < scop->cmds_size) {
+        struct prl_scop_cmd *cmd = &scop->cmds[scopinst->replay_pos];
+        if (cmd->type == type) {
+            scopinst->replay_pos += 1;
+            add_counter(scopinst, counter_replayed_cmds, 1);
+            return cmd;
+        }
+    }
+
+    replay_diverged(scopinst);
+    return NULL;
+}
+
+static struct prl_scop_cmd_memref record_memref(prl_scop scop, prl_mem mem) {
+    struct prl_scop_cmd_memref result = {NO_CMD, NULL};
+    for (size_t i = scop->cmds_size; i > 0; i -= 1) {
+        struct prl_scop_cmd *cmd = &scop->cmds[i - 1];
+        if (cmd->type == scop_cmd_get_mem && cmd->mem == mem) {
+            result.mem_cmd = i - 1;
+            return result;
+        }
+    }
+
+    assert(!mem->scopinst && "Local mems are only created by prl_scop_get_mem");
+    result.gmem = mem;
+    return result;
+}
+
+static bool replay_memref_matches(prl_scop scop, const struct prl_scop_cmd_memref *memref, prl_mem mem) {
+    if (memref->mem_cmd == NO_CMD)
+        return memref->gmem == mem;
+    return scop->cmds[memref->mem_cmd].mem == mem;
+}
+
+// For prl_scop_host_to_device and prl_scop_device_to_host
+static void replay_mem_cmd(prl_scop_instance scopinst, enum prl_scop_cmd_type type, prl_mem mem) {
+    switch (scopinst->replay) {
+    case replay_recording: {
+        struct prl_scop_cmd_memref memref = record_memref(scopinst->scop, mem);
+        record_cmd(scopinst, type)->memref = memref;
+    } break;
+    case replay_replaying: {
+        struct prl_scop_cmd *cmd = replay_cmd(scopinst, type);
+        if (cmd && !replay_memref_matches(scopinst->scop, &cmd->memref, mem))
+            replay_diverged(scopinst);
+    } break;
+    default:
+        break;
+    }
+}
+
+// Called by prl_scop_leave before local mems are freed
+static void replay_leave(prl_scop_instance scopinst) {
+    prl_scop scop = scopinst->scop;
+
+    if (scopinst->replay == replay_replaying && scopinst->replay_pos != scop->cmds_size)
+        replay_diverged(scopinst);
+
+    if (scopinst->replay != replay_off) {
+        // Keep the device buffers of local mems for the next instance
+        for (size_t i = 0; i < scop->cmds_size; i += 1) {
+            struct prl_scop_cmd *cmd = &scop->cmds[i];
+            if (cmd->type != scop_cmd_get_mem || cmd->gmem || cmd->clmem || !cmd->mem)
+                continue;
+
+            prl_mem lmem = cmd->mem;
+            if (lmem->clmem && lmem->dev_owning && !lmem->dev_shared) {
+                cmd->clmem = lmem->clmem;
+                lmem->dev_owning = false;
+            }
+        }
+
+        if (scopinst->replay == replay_recording)
+            scop->recorded = true;
+    }
+
+    for (size_t i = 0; i < scop->cmds_size; i += 1)
+        scop->cmds[i].mem = NULL;
+}
+
+prl_scop_instance prl_scop_enter_named(prl_scop *scopref, const char *name) {
     assert(scopref);
     prl_init();
 
+    // Finalize instances left by prl_scop_leave_async that completed in the meantime
+    poll_completions(false);
+    host_faults_fold();
+    poll_window_dump();
+
     prl_scop scop = *scopref;
     if (!scop) {
         scop = malloc_checked(NOSCOPINST, sizeof *scop);
         memset(scop, 0, sizeof *scop);
+        scop->next = global_state.scops;
+        global_state.scops = scop;
         *scopref = scop;
     }
+    if (name && !scop->name) {
+        size_t len = strlen(name);
+        scop->name = malloc_checked(NOSCOPINST, len + 1);
+        memcpy(scop->name, name, len + 1);
+    }
+    if (scop->inflight && global_state.config.scop_replay) {
+        // The recording and its cached buffers are not to be shared between instances
+        completion_finalize(scop->inflight);
+    }
 
     prl_time_t scop_start = timestamp();
     struct prl_scop_inst_struct dummystat = {0};
@@ -2783,9 +5481,17 @@ prl_scop_instance prl_scop_enter(prl_scop *scopref) {
     scopinst->scop = scop;
     scopinst->queue = clqueue;
     scopinst->scop_start = scop_start;
+    scopinst->profiled = sample_instance(scop);
+    scopinst->serial = global_state.sample_instances;
+    if (global_state.config.scop_replay)
+        scopinst->replay = scop->recorded ? replay_replaying : replay_recording;
     return scopinst;
 }
 
+prl_scop_instance prl_scop_enter(prl_scop *scopref) {
+    return prl_scop_enter_named(scopref, NULL);
+}
+
 static void free_events(prl_scop_instance scopinst) {
     assert(scopinst);
 
@@ -2812,101 +5518,39 @@ static int cmp_prof(const void *lhs_ptr, const void *rhs_ptr) {
     //return  lhs->start - rhs->start;
 }
 
-enum prof_kind {
-    prof_all,
-    prof_to_device,
-    prof_compute,
-    prof_to_host
-};
-
 static void accumulate_gpu_durations(struct event_prof *profs, size_t n_profs, enum prof_kind prof_kind, prl_time_t *working_result, prl_time_t *idle_result) {
-    bool first = true;
-    prl_time_t prev_stop;
-    //prl_time_t prev_match_stop;
-    //bool first_match = true;
-    prl_time_t accumulated_working = 0;
-    prl_time_t accumulated_idle = 0;
+    struct gpu_durations acc = {.started = false};
 
     if (working_result)
-        accumulated_working = *working_result;
-    if (accumulated_idle)
-        accumulated_idle = *idle_result;
+        acc.working = *working_result;
+    if (idle_result)
+        acc.idle = *idle_result;
 
     for (int i = 0; i < n_profs; i += 1) {
         struct event_prof *prof = &profs[i];
-        //cl_event event = prof->event;
-        prl_time_t start = prof->start;
-        prl_time_t stop = prof->stop;
-        bool match;
-        cl_command_type cmdty = prof->cmdty;
-
-        switch (prof_kind) {
-        case prof_all:
-            match = true;
-            break;
-        case prof_to_device:
-            match = (cmdty == CL_COMMAND_WRITE_BUFFER) || (cmdty == CL_COMMAND_WRITE_IMAGE) || (cmdty == CL_COMMAND_UNMAP_MEM_OBJECT);
-            break;
-        case prof_compute:
-            match = (cmdty == CL_COMMAND_NDRANGE_KERNEL) || (cmdty == CL_COMMAND_TASK) || (cmdty == CL_COMMAND_NATIVE_KERNEL);
-            break;
-        case prof_to_host:
-            match = (cmdty == CL_COMMAND_READ_BUFFER) || (cmdty == CL_COMMAND_READ_IMAGE) || (cmdty == CL_COMMAND_MAP_BUFFER) || (cmdty == CL_COMMAND_MAP_IMAGE);
-            break;
-        }
-        if (!match)
+        if (!is_prof_kind(prof_kind, prof->cmdty))
             continue;
-
-        if (first) {
-            prev_stop = start;
-            first = false;
-        }
-
-        if (prev_stop <= start) {
-            // Case 1: |<- prev ->|  |<- cur ->|
-            assert(start <= stop);
-
-            prl_time_t cur_duration = stop - start;
-            prl_time_t unused_duration = start - prev_stop;
-
-            accumulated_working += cur_duration;
-            accumulated_idle += unused_duration;
-
-            prev_stop = stop;
-        } else if (stop <= prev_stop) {
-            // Case 2: |<-   prev   ->|
-            //           |<- cur ->|
-            assert(start <= stop);
-        } else {
-            // Case 3: |<- prev ->|
-            //                |<- cur ->|
-            assert(start <= prev_stop);
-            assert(prev_stop <= stop);
-
-            prl_time_t cur_duration = stop - prev_stop;
-
-            accumulated_working += cur_duration;
-
-            prev_stop = stop;
-        }
+        accumulate_gpu_duration(&acc, prof->start, prof->stop);
     }
 
     if (working_result)
-        *working_result = accumulated_working;
+        *working_result = acc.working;
     if (idle_result)
-        *idle_result = accumulated_idle;
+        *idle_result = acc.idle;
 }
 
 static void eval_events(prl_scop_instance scopinst) {
     assert(scopinst);
 
-    if (!global_state.config.gpu_profiling)
+    if (!need_store_events(scopinst))
         return;
 
     size_t n_events = scopinst->event_size;
     struct event_prof *profs = malloc_checked(scopinst, n_events * sizeof *profs);
 
     for (int i = 0; i < n_events; i += 1) {
+        cl_ulong queued = 0;
+        cl_ulong submit = 0;
         cl_ulong start = 0;
         cl_ulong stop = 0;
         struct prl_pending_event *pendev = &scopinst->pending_events[i];
@@ -2914,6 +5558,8 @@ static void eval_events(prl_scop_instance scopinst) {
         cl_command_type cmdty;
         cl_int status;
 
+        clGetEventProfilingInfo_checked(scopinst, event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+        clGetEventProfilingInfo_checked(scopinst, event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL);
         clGetEventProfilingInfo_checked(scopinst, event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
         clGetEventProfilingInfo_checked(scopinst, event, CL_PROFILING_COMMAND_END, sizeof(stop), &stop, NULL);
         clGetEventInfo_checked(scopinst, event, CL_EVENT_COMMAND_TYPE, sizeof(cmdty), &cmdty, NULL);
@@ -2923,10 +5569,20 @@ static void eval_events(prl_scop_instance scopinst) {
         assert(start <= stop);
         prl_time_t duration = stop - start;
 
-        add_time(scopinst, clcommand_to_stat_entry(cmdty), duration);
+        enum prl_stat_entry entry = clcommand_to_stat_entry(cmdty);
+        add_time(scopinst, entry, duration);
         if (pendev->type == pending_compute) {
             pendev->kernel->total_duration += duration;
             pendev->kernel->total_count += 1;
+            pendev->kernel->duration_hist[latency_bucket(duration)] += 1;
+        }
+        if (pendev->type == pending_transfer)
+            count_transfer_duration(pendev->mem, cmdty, duration);
+
+        prl_time_t queue_latency, submit_latency;
+        if (record_latency(entry, (pendev->type == pending_compute) ? pendev->kernel : NULL, queued, submit, start, &queue_latency, &submit_latency)) {
+            add_time(scopinst, stat_gpu_queue_latency, queue_latency);
+            add_time(scopinst, stat_gpu_submit_latency, submit_latency);
         }
 
         if (global_state.config.gpu_detailed_profiling)
@@ -2968,13 +5624,18 @@ static void ensure_host_allocated(prl_scop_instance scopinst, prl_mem mem) {
 
     switch (mem->type) {
     case alloc_type_rwbuf:
-        mem->host_mem = malloc_checked(scopinst, mem->size);
+        if (host_paging_enabled() && !mem->scopinst && mem->size > 0)
+            host_alloc_paged(scopinst, mem);
+        else
+            mem->host_mem = malloc_checked(scopinst, mem->size);
         mem->host_owning = true;
         mem->host_exposed = false;
         break;
     default:
         assert(!"No host allocation for this type");
     }
+    if (!mem->scopinst)
+        global_state.global_mems_gen += 1;
 
     assert(mem->host_mem);
 }
@@ -2985,10 +5646,26 @@ static bool ensure_on_host(prl_scop_instance scopinst, prl_mem mem) {
     assert(scopinst);
     assert(mem);
 
-    if (mem->loc == loc_host || mem->loc == loc_transferring_to_host) {
+    if (mem->loc == loc_host) {
         // Nothing to do
         return false;
     }
+    if (mem->loc == loc_transferring_to_host) {
+        // The host must not use the buffer before the transfer has completed
+        return true;
+    }
+
+    if (mem->host_lazy && (mem->loc & loc_bit_dev_is_current)) {
+        // Keep the data on the device; it will be read back at the host's first access
+        return false;
+    }
+
+    if (mem->loc == loc_shared) {
+        // Keep the device copy unless the host might modify the buffer without us noticing
+        if (!host_writes_tracked(mem))
+            mem->loc = loc_host;
+        return false;
+    }
 
     ensure_host_allocated(scopinst, mem);
 
@@ -3002,7 +5679,7 @@ static bool ensure_on_host(prl_scop_instance scopinst, prl_mem mem) {
 
     case alloc_type_map: {
         cl_event event = NULL;
-        void *host_ptr = clEnqueueMapBuffer_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), mem->host_writable ? CL_MAP_WRITE : 0, 0, mem->size, 0, NULL, need_events() ? &event : NULL);
+        void *host_ptr = clEnqueueMapBuffer_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), mem->host_writable ? CL_MAP_WRITE : 0, 0, mem->size, 0, NULL, need_events(scopinst) ? &event : NULL);
         assert(host_ptr == mem->host_mem);
         mem->loc = is_blocking() ? loc_host : loc_transferring_to_host;
         mem->transferevent = event;
@@ -3022,82 +5699,273 @@ static void mem_event_finished(prl_scop_instance scopinst, prl_mem mem) {
     assert(is_valid_loc(mem));
 
     if (mem->loc & loc_mask_transferring) {
-        assert(!need_store_events() || !mem->transferevent || has_transfer_completed(scopinst, mem));
+        assert(!need_store_events(scopinst) || !mem->transferevent || has_transfer_completed(scopinst, mem));
     }
 
-    //TODO: buffer transferred from is not yet obsolete; we could still use it for reading.
+    // The buffer transferred from is not obsolete (unless mapped); keep using it for reading
     switch (mem->loc) {
     case loc_transferring_to_dev:
         mem->transferevent = NULL;
-        mem->loc = loc_dev;
+        mem->loc = (mem->type == alloc_type_rwbuf) ? loc_shared : loc_dev;
+        break;
+
+    case loc_transferring_to_host:
+        mem->transferevent = NULL;
+        if (mem->type == alloc_type_rwbuf) {
+            dirty_rebase(mem);
+            mem->loc = loc_after_readback(mem);
+        } else {
+            mem->loc = loc_host;
+        }
+        break;
+
+    default:
         break;
+    }
+
+    assert(is_valid_loc(mem));
+}
+
+// Make the host-visible buffers current on the host; returns whether the host has to wait for the device before using them
+static bool scop_leave_prepare(prl_scop_instance scopinst) {
+    prl_mem lmem = scopinst->local_mems;
+	bool require_wait = false;
+    while (lmem) {
+        assert(lmem->scopinst);
+        lmem->upload_pending = NULL; // Not used by any kernel
+        if (lmem->host_readable || lmem->host_writable)
+            require_wait |= ensure_on_host(scopinst, lmem);
+        lmem = lmem->mem_next;
+
+		// We are going to free the local buffers; computation needing them might still be running, so we need all computations to finish.
+		//require_wait = true;
+	}
+    for (int i = 0; i < scopinst->mems_size; i += 1) {
+        prl_mem gmem = scopinst->mems[i];
+        gmem->upload_pending = NULL;
+        if (gmem->host_readable || gmem->host_writable)
+            require_wait |= ensure_on_host(scopinst, gmem);
+
+    }
+
+    return require_wait;
+}
+
+// All commands of the instance have completed
+static void scop_leave_completed(prl_scop_instance scopinst) {
+    progress_wait(scopinst);
+
+    // FIXME: Events are not evaluated if not here.
+    eval_events(scopinst);
+
+    for (int i = 0; i < scopinst->mems_size; i += 1) {
+        prl_mem gmem = scopinst->mems[i];
+        mem_event_finished(scopinst, gmem);
+    }
+    for (size_t i = 0; i < scopinst->pinned_size; i += 1)
+        mem_event_finished(scopinst, scopinst->pinned[i]);
+}
+
+// Add the instance's statistics to its SCoP's
+static void scop_stat_merge(prl_scop_instance scopinst) {
+    prl_scop scop = scopinst->scop;
+    for (int i = 0; i < STAT_ENTRIES; i += 1) {
+        scop->stat.entries[i] += scopinst->stat.entries[i];
+        scop->stat.counts[i] += scopinst->stat.counts[i];
+    }
+    for (int i = 0; i < COUNTER_ENTRIES; i += 1)
+        scop->stat.counters[i] += scopinst->stat.counters[i];
+    scop->instances += 1;
+    if (scopinst->profiled)
+        scop->profiled_instances += 1;
+}
+
+// CPU time of an instance from entering until leaving
+static void scop_add_time(prl_scop scop, prl_time_t duration) {
+    add_time(NOSCOPINST, stat_cpu_scop, duration);
+    if (!PRL_PROFILING)
+        return;
+    scop->stat.entries[stat_cpu_scop] += duration;
+    scop->stat.counts[stat_cpu_scop] += 1;
+}
+
+// Free the instance and its local buffers
+static void scop_leave_release(prl_scop_instance scopinst) {
+    prl_mem lmem;
+
+    replay_leave(scopinst);
+    lmem = scopinst->local_mems;
+    while (lmem) {
+        prl_mem next = lmem->mem_next;
+        mem_event_finished(scopinst, lmem);
+        mem_free(scopinst, lmem);
+        lmem = next;
+    }
+    if (scopinst->scop->rerecord) {
+        free_scop_cmds(scopinst, scopinst->scop);
+        scopinst->scop->rerecord = false;
+    }
+
+    free_events(scopinst);
+    assert(!scopinst->progress_inflight);
+    scop_stat_merge(scopinst);
+    for (int i = 0; i < scopinst->mems_size; i += 1) {
+        assert(scopinst->mems[i]->scop_refs > 0);
+        scopinst->mems[i]->scop_refs -= 1;
+    }
+    for (size_t i = 0; i < scopinst->pinned_size; i += 1) {
+        assert(scopinst->pinned[i]->scop_refs > 0);
+        scopinst->pinned[i]->scop_refs -= 1;
+    }
+    free_checked(scopinst, scopinst->pinned);
+	if (scopinst->queue != global_state.queue)
+		clReleaseCommandQueue_checked(scopinst, scopinst->queue);
+    free_checked(scopinst, scopinst->mems);
+    free_checked(NOSCOPINST, scopinst);
+}
+
+void prl_scop_leave(prl_scop_instance scopinst) {
+    assert(scopinst);
+    assert(prl_initialized);
 
-    case loc_transferring_to_host:
-        mem->transferevent = NULL;
-        mem->loc = loc_host;
-        break;
+    prl_scop scop = scopinst->scop;
+    prl_time_t scop_start = scopinst->scop_start;
+    bool require_wait = scop_leave_prepare(scopinst);
 
-    default:
-        break;
-    }
+	// TODO: More fine-grained waiting (wait for each event)
+	// The progress thread must not retire events of an instance that is gone already
+	if (require_wait || (global_state.config.gpu_profiling && is_profiled(scopinst)) || progress_thread_enabled() || scopinst->queue != global_state.queue) {
+		clFinish_checked(scopinst, scopinst->queue);
+        scop_leave_completed(scopinst);
+	}
+    scop_leave_release(scopinst);
 
-    assert(is_valid_loc(mem));
+    prl_time_t scop_stop = timestamp();
+    scop_add_time(scop, scop_stop - scop_start);
 }
 
-void prl_scop_leave(prl_scop_instance scopinst) {
+static void CL_CALLBACK completion_notify(cl_event event, cl_int event_command_exec_status, void *user_data) {
+    struct prl_completion_notify *notify = user_data;
+    (*notify->callback)(notify->user);
+    free(notify); // Not free_checked: we might be on a different thread
+}
+
+prl_scop_completion prl_scop_leave_async(prl_scop_instance scopinst, prl_scop_completion_callback callback, void *user) {
     assert(scopinst);
     assert(prl_initialized);
 
     prl_time_t scop_start = scopinst->scop_start;
+    scop_leave_prepare(scopinst);
+
+    prl_scop_completion completion = malloc_checked(scopinst, sizeof *completion);
+    memset(completion, 0, sizeof *completion);
+    completion->scopinst = scopinst;
+    completion->marker = clEnqueueMarker_checked(scopinst, scopinst->queue);
+    if (callback) {
+        struct prl_completion_notify *notify = malloc(sizeof *notify);
+        assert(notify);
+        notify->callback = callback;
+        notify->user = user;
+        clSetEventCallback_checked(scopinst, completion->marker, CL_COMPLETE, &completion_notify, notify);
+    }
+    clFlush_checked(scopinst, scopinst->queue);
 
-    prl_mem lmem = scopinst->local_mems;
-	bool require_wait = false;
-    while (lmem) {
-        assert(lmem->scopinst);
-        if (lmem->host_readable || lmem->host_writable)
-            ensure_on_host(scopinst, lmem);
-        lmem = lmem->mem_next;
+    // Buffers stay locked until the instance is finalized
+    for (int i = 0; i < scopinst->mems_size; i += 1) {
+        prl_mem gmem = scopinst->mems[i];
+        assert(!gmem->pending_completion);
+        gmem->pending_completion = completion;
+    }
+    for (size_t i = 0; i < scopinst->pinned_size; i += 1) {
+        prl_mem gmem = scopinst->pinned[i];
+        assert(!gmem->pending_completion);
+        gmem->pending_completion = completion;
+    }
+
+    completion->next = global_state.completions;
+    global_state.completions = completion;
+    scopinst->scop->inflight = completion;
+
+    prl_time_t scop_stop = timestamp();
+    scop_add_time(scopinst->scop, scop_stop - scop_start);
+    return completion;
+}
+
+static bool has_completed(prl_scop_completion completion) {
+    if (!completion->scopinst)
+        return true;
+    return has_event_completed(completion->scopinst, completion->marker);
+}
+
+// Wait for the instance to complete and finish what prl_scop_leave would do; the handle remains allocated
+static void completion_finalize(prl_scop_completion completion) {
+    prl_scop_instance scopinst = completion->scopinst;
+    if (!scopinst)
+        return;
+
+    clWaitForEvent_checked(scopinst, completion->marker);
+    clReleaseEvent_checked(scopinst, completion->marker);
+    completion->marker = NULL;
+    completion->scopinst = NULL;
+    if (scopinst->scop->inflight == completion)
+        scopinst->scop->inflight = NULL;
+
+    prl_scop_completion *link = &global_state.completions;
+    while (*link != completion) {
+        assert(*link);
+        link = &(*link)->next;
+    }
+    *link = completion->next;
+    completion->next = NULL;
 
-		// We are going to free the local buffers; computation needing them might still be running, so we need all computations to finish.
-		//require_wait = true;
-	}
     for (int i = 0; i < scopinst->mems_size; i += 1) {
         prl_mem gmem = scopinst->mems[i];
-        if (gmem->host_readable || gmem->host_writable)
-            require_wait |= ensure_on_host(scopinst, gmem);
+        if (gmem->pending_completion == completion)
+            gmem->pending_completion = NULL;
+    }
+    for (size_t i = 0; i < scopinst->pinned_size; i += 1) {
+        prl_mem gmem = scopinst->pinned[i];
+        if (gmem->pending_completion == completion)
+            gmem->pending_completion = NULL;
+    }
+
+    scop_leave_completed(scopinst);
+    scop_leave_release(scopinst);
+}
 
+static void poll_completions(bool wait) {
+    prl_scop_completion completion = global_state.completions;
+    while (completion) {
+        prl_scop_completion next = completion->next;
+        if (wait || has_completed(completion))
+            completion_finalize(completion);
+        completion = next;
     }
+}
 
-	// TODO: More fine-grained waiting (wait for each event)
-	if (require_wait || global_state.config.gpu_profiling || scopinst->queue != global_state.queue) {
-		// TODO: Extract this into function that globally waits and sets buffer status
-		clFinish_checked(scopinst, scopinst->queue);
+// Before accessing a buffer that might still be used by an instance left with prl_scop_leave_async
+static void mem_wait_pending(prl_mem mem) {
+    if (mem->pending_completion)
+        completion_finalize(mem->pending_completion);
+    assert(!mem->pending_completion);
+}
 
-		// FIXME: Events are not evaluated if not here.
-		eval_events(scopinst);
+void prl_scop_wait(prl_scop_completion completion) {
+    assert(completion);
 
-		for (int i = 0; i < scopinst->mems_size; i += 1) {
-			prl_mem gmem = scopinst->mems[i];
-			mem_event_finished(scopinst, gmem);
-		}
-	}
+    completion_finalize(completion);
+    free_checked(NOSCOPINST, completion);
+}
 
-    lmem = scopinst->local_mems;
-    while (lmem) {
-        prl_mem next = lmem->mem_next;
-        mem_event_finished(scopinst, lmem);
-        mem_free(scopinst, lmem);
-        lmem = next;
-    }
+bool prl_scop_test(prl_scop_completion completion) {
+    assert(completion);
 
-    free_events(scopinst);
-	if (scopinst->queue != global_state.queue)
-		clReleaseCommandQueue_checked(scopinst, scopinst->queue);
-    free_checked(scopinst, scopinst->mems);
-    free_checked(NOSCOPINST, scopinst);
+    if (!has_completed(completion))
+        return false;
 
-    prl_time_t scop_stop = timestamp();
-    add_time(NOSCOPINST, stat_cpu_scop, scop_stop - scop_start);
+    completion_finalize(completion);
+    free_checked(NOSCOPINST, completion);
+    return true;
 }
 
 void prl_scop_program_from_file(prl_scop_instance scopinst, prl_program *programref, const char *filename, const char *compiler_options) {
@@ -3129,6 +5997,34 @@ void prl_scop_program_from_file(prl_scop_instance scopinst, prl_program *program
     program->filename = strdup(filename);
 }
 
+// Count builds of the same source and options
+static void record_build(const char *str, size_t str_size, const char *build_options, prl_time_t duration) {
+    uint64_t hash[2];
+    uint64_t options_hash[2] = {0, 0};
+    dedup_hash(str, str_size, hash);
+    if (build_options)
+        dedup_hash(build_options, strlen(build_options), options_hash);
+    hash[0] ^= fmix64(options_hash[0]);
+    hash[1] ^= fmix64(options_hash[1]);
+
+    for (size_t i = 0; i < global_state.builds_size; i += 1) {
+        struct prl_build_record *record = &global_state.builds[i];
+        if (record->hash[0] == hash[0] && record->hash[1] == hash[1]) {
+            record->builds += 1;
+            record->duration += duration;
+            return;
+        }
+    }
+
+    global_state.builds_size += 1;
+    global_state.builds = realloc_checked(NOSCOPINST, global_state.builds, global_state.builds_size * sizeof *global_state.builds);
+    struct prl_build_record *record = &global_state.builds[global_state.builds_size - 1];
+    record->hash[0] = hash[0];
+    record->hash[1] = hash[1];
+    record->builds = 1;
+    record->duration = 0;
+}
+
 // str_size including NULL character
 void prl_scop_program_from_str(prl_scop_instance scopinst, prl_program *programref, const char *str, size_t str_size, const char *build_options) {
     assert(scopinst);
@@ -3144,7 +6040,10 @@ void prl_scop_program_from_str(prl_scop_instance scopinst, prl_program *programr
             str_size -= 1;
         cl_program clprogram = clCreateProgramWithSource_checked(scopinst, global_state.context, 1, &str, &str_size);
 
+        prl_time_t build_start = timestamp_force();
         bool err = clBuildProgram_checked(scopinst, clprogram, 0, NULL, build_options, NULL, NULL);
+        if (global_state.config.advise)
+            record_build(str, str_size, build_options, timestamp_force() - build_start);
         if (err) { //TODO: Unified error handling
             fprintf(stderr, "Error during program build\n");
             size_t msgs_size;
@@ -3167,6 +6066,16 @@ void prl_scop_program_from_str(prl_scop_instance scopinst, prl_program *programr
     assert(program->program);
 }
 
+void prl_kernel_set_pure(prl_kernel kernel, bool pure) {
+    assert(kernel);
+    kernel->pure = pure;
+}
+
+void prl_kernel_set_sliceable(prl_kernel kernel, bool sliceable) {
+    assert(kernel);
+    kernel->sliceable = sliceable;
+}
+
 void prl_scop_init_kernel(prl_scop_instance scop, prl_kernel *kernelref, prl_program program, const char *kernelname) {
     assert(scop);
     assert(kernelref);
@@ -3202,40 +6111,238 @@ static bool is_mem_registered(prl_scop_instance scopinst, prl_mem gmem) {
     return false;
 }
 
-prl_mem prl_scop_get_mem(prl_scop_instance scopinst, void *host_mem, size_t size, const char *name) {
-    assert(scopinst);
-    assert(size > 0);
+// Keep a global mem from being evicted while the instance might use it
+static void scop_pin_mem(prl_scop_instance scopinst, prl_mem mem) {
+    if (mem->scopinst || is_mem_registered(scopinst, mem))
+        return;
+    for (size_t i = 0; i < scopinst->pinned_size; i += 1) {
+        if (scopinst->pinned[i] == mem)
+            return;
+    }
+
+    scopinst->pinned = realloc_checked(scopinst, scopinst->pinned, (scopinst->pinned_size + 1) * sizeof *scopinst->pinned);
+    scopinst->pinned[scopinst->pinned_size] = mem;
+    scopinst->pinned_size += 1;
+    mem->scop_refs += 1;
+}
+
+static prl_mem scop_create_local_mem(prl_scop_instance scopinst, void *host_mem, size_t size, const char *name) {
+    prl_mem lmem = prl_mem_create_empty(size, name, scopinst);
+    if (host_mem) {
+        prl_mem_init_rwbuf_host(lmem,
+                                host_mem, false, true, true, true,
+                                true, true, loc_host);
+    } else {
+        // No host memory available
+        prl_mem_init_rwbuf_none(lmem,
+                                true, true,
+                                true, true);
+    }
+
+    return lmem;
+}
 
+static prl_mem scop_get_mem(prl_scop_instance scopinst, void *host_mem, size_t size, const char *name, bool *registered) {
+    *registered = false;
     if (host_mem) {
         prl_mem gmem = prl_mem_lookup_global_ptr(host_mem, size);
         if (gmem) {
+            mem_wait_pending(gmem);
             if (!gmem->name && name) {
                 gmem->name = strdup(name);
             }
             // TODO: Should only the amount of bytes specified by size.
             if (gmem->size < size)
 		    gmem->size = size;
-            if (!is_mem_registered(scopinst, gmem))
+            if (!is_mem_registered(scopinst, gmem)) {
                 push_back_mem(scopinst, gmem);
+                *registered = true;
+            }
             assert(is_valid_loc(gmem));
             return gmem;
         }
     }
 
     // If it is not a user-allocated memory location, create a temporary local one
-    prl_mem lmem = prl_mem_create_empty(size, name, scopinst);
-    if (host_mem) {
-        prl_mem_init_rwbuf_host(lmem,
-                                host_mem, false, true, true, true,
-                                true, true, loc_host);
-    } else {
-        // No host memory available
-        prl_mem_init_rwbuf_none(lmem,
-                                true, true,
-                                true, true);
+    return scop_create_local_mem(scopinst, host_mem, size, name);
+}
+
+static void replay_reuse_clmem(struct prl_scop_cmd *cmd, prl_mem lmem) {
+    if (!cmd->clmem)
+        return;
+
+    assert(lmem->scopinst);
+    assert(!lmem->clmem);
+    lmem->clmem = cmd->clmem;
+    lmem->dev_owning = false;
+}
+
+prl_mem prl_scop_get_mem(prl_scop_instance scopinst, void *host_mem, size_t size, const char *name) {
+    assert(scopinst);
+    assert(size > 0);
+
+    bool registered;
+    prl_mem mem;
+    switch (scopinst->replay) {
+    case replay_recording: {
+        mem = scop_get_mem(scopinst, host_mem, size, name, &registered);
+        struct prl_scop_cmd *cmd = record_cmd(scopinst, scop_cmd_get_mem);
+        cmd->host_mem = host_mem;
+        cmd->size = size;
+        cmd->gmem = mem->scopinst ? NULL : mem;
+        cmd->registered = registered;
+        cmd->global_gen = global_state.global_mems_gen;
+        cmd->mem = mem;
+        return mem;
     }
 
-    return lmem;
+    case replay_replaying: {
+        struct prl_scop_cmd *cmd = replay_cmd(scopinst, scop_cmd_get_mem);
+        if (!cmd)
+            break;
+        if (cmd->host_mem != host_mem || cmd->size != size) {
+            replay_diverged(scopinst);
+            break;
+        }
+
+        if (cmd->global_gen == global_state.global_mems_gen) {
+            // Same lookup result as when recorded
+            if (cmd->gmem) {
+                mem = cmd->gmem;
+                mem_wait_pending(mem);
+                if (cmd->registered)
+                    push_back_mem(scopinst, mem);
+            } else {
+                mem = scop_create_local_mem(scopinst, host_mem, size, name);
+                replay_reuse_clmem(cmd, mem);
+            }
+            cmd->mem = mem;
+            return mem;
+        }
+
+        // Global mems have changed since; check whether the lookup still has the same result
+        mem = scop_get_mem(scopinst, host_mem, size, name, &registered);
+        if ((mem->scopinst ? NULL : mem) != cmd->gmem || registered != cmd->registered) {
+            replay_diverged(scopinst);
+            return mem;
+        }
+        if (!cmd->gmem)
+            replay_reuse_clmem(cmd, mem);
+        cmd->global_gen = global_state.global_mems_gen;
+        cmd->mem = mem;
+        return mem;
+    }
+
+    default:
+        break;
+    }
+
+    return scop_get_mem(scopinst, host_mem, size, name, &registered);
+}
+
+prl_mem prl_scop_get_mem_rect(prl_scop_instance scopinst, void *host_mem, size_t size, size_t elt_size, int dims, const size_t pitches[], const size_t box_offset[], const size_t box_size[], const char *name) {
+    assert(scopinst);
+    assert(elt_size > 0);
+    assert(1 <= dims && dims <= 3);
+    assert(dims == 1 || pitches);
+    assert(box_offset);
+    assert(box_size);
+
+    prl_mem mem = prl_scop_get_mem(scopinst, host_mem, size, name);
+
+    // PRL-managed memory is kept coherent as a whole; there is also nothing to transfer without a host buffer.
+    if (!mem->scopinst || !host_mem)
+        return mem;
+
+    // OpenCL's rect functions order the dimensions from innermost to outermost; the innermost one is in bytes.
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {1, 1, 1};
+    size_t row_pitch = 0;
+    size_t slice_pitch = 0;
+    for (int i = 0; i < dims; i += 1) {
+        assert(box_size[i] > 0);
+        int cldim = dims - 1 - i;
+        origin[cldim] = box_offset[i];
+        region[cldim] = box_size[i];
+    }
+    origin[0] *= elt_size;
+    region[0] *= elt_size;
+    if (dims >= 2)
+        row_pitch = pitches[dims - 2];
+    if (dims >= 3)
+        slice_pitch = pitches[dims - 3];
+
+    assert(dims < 2 || region[0] + origin[0] <= row_pitch);
+    assert(dims < 3 || (origin[1] + region[1]) * row_pitch <= slice_pitch);
+    assert(origin[0] + (origin[1] + region[1] - 1) * row_pitch + (origin[2] + region[2] - 1) * slice_pitch + region[0] <= size);
+
+    mem->rect = true;
+    memcpy(mem->rect_origin, origin, sizeof origin);
+    memcpy(mem->rect_region, region, sizeof region);
+    mem->rect_row_pitch = row_pitch;
+    mem->rect_slice_pitch = slice_pitch;
+    return mem;
+}
+
+// A single device buffer cannot hold the mem; kernels can only use it in chunks (see prl_scop_call_streamed)
+static bool is_oversized(prl_mem mem) {
+    return mem->type == alloc_type_rwbuf && global_state.dev_max_alloc_size > 0 && mem->size > global_state.dev_max_alloc_size;
+}
+
+static bool is_evictable(prl_mem mem) {
+    return mem->dev_resident && mem->dev_owning && !mem->dev_exposed && mem->scop_refs == 0 && !mem->pending_completion && !(mem->loc & loc_mask_transferring);
+}
+
+// Release the device buffer of a global mem; its content is kept on the host and uploaded again on the next use
+static void mem_evict(prl_scop_instance scopinst, prl_mem mem) {
+    assert(is_evictable(mem));
+    assert(mem->type == alloc_type_rwbuf);
+
+    if (mem->host_lazy) {
+        host_materialize(scopinst, mem);
+    } else if (mem->loc == loc_dev) {
+        ensure_host_allocated(scopinst, mem);
+
+        cl_command_queue queue = acquire_blocking_queue(scopinst);
+        clEnqueueReadBuffer_checked(scopinst, queue, mem->clmem, CL_BLOCKING_TRUE, 0, mem->size, mem->host_mem, 0, NULL, NULL);
+        count_transfer(scopinst, mem, dir_to_host, mem->size);
+        release_blocking_queue(scopinst, queue);
+        mem->loc = loc_host;
+    }
+    if (mem->loc & loc_bit_host_is_current)
+        mem->loc = loc_host;
+    dirty_invalidate(mem); // A new device buffer has no baseline
+
+    add_counter(scopinst, counter_evictions, 1);
+    add_counter(scopinst, counter_bytes_evicted, mem->size);
+    lru_remove(mem);
+    assert(!(mem->loc & loc_bit_dev_is_current)); // The content must not only be in the released buffer
+    clReleaseMemObject_checked(scopinst, mem->clmem);
+    mem->clmem = NULL;
+    mem->dev_owning = false;
+}
+
+// Evict least recently used buffers until size more bytes fit into the budget; buffers in use by a SCoP instance are kept even if the budget is exceeded
+static void dev_make_room(prl_scop_instance scopinst, size_t size) {
+    cl_ulong budget = global_state.config.device_memory_budget;
+    if (budget == 0)
+        return;
+
+    // Cached buffers that no mem uses anymore go first; their content is not needed
+    while (global_state.dev_resident_bytes + size > budget) {
+        struct prl_dedup_entry *entry = dedup_lru_unused();
+        if (!entry)
+            break;
+        dedup_entry_release(scopinst, entry);
+    }
+
+    prl_mem victim = global_state.lru_last;
+    while (victim && global_state.dev_resident_bytes + size > budget) {
+        prl_mem prev = victim->lru_prev;
+        if (is_evictable(victim))
+            mem_evict(scopinst, victim);
+        victim = prev;
+    }
 }
 
 static void ensure_dev_allocated(prl_scop_instance scopinst, prl_mem mem) {
@@ -3246,9 +6353,16 @@ static void ensure_dev_allocated(prl_scop_instance scopinst, prl_mem mem) {
 
     switch (mem->type) {
     case alloc_type_rwbuf:
+        if (is_oversized(mem)) {
+            fprintf(stderr, "Buffer %s of %zu bytes exceeds CL_DEVICE_MAX_MEM_ALLOC_SIZE; it can only be passed to kernels with an item_size\n", mem->name ? mem->name : "(unnamed)", mem->size);
+            exit(1);
+        }
+        dev_make_room(scopinst, mem->size);
         mem->clmem = clCreateBuffer_checked(scopinst, global_state.context, CL_MEM_READ_WRITE /*| CL_MEM_COPY_HOST_PTR*/, mem->size, NULL /*mem->host_mem*/);
         mem->dev_owning = true;
         mem->dev_exposed = false;
+        if (!mem->scopinst)
+            lru_push_front(mem);
         break;
     default:
         assert(!"No device allocation for this type");
@@ -3266,28 +6380,26 @@ static void *get_exposed_host(prl_scop_instance scopinst, prl_mem mem) {
 void *prl_mem_get_host_mem(prl_mem mem) {
     assert(mem);
 
+    mem_wait_pending(mem);
+    if (mem->host_lazy)
+        host_materialize(NOSCOPINST, mem);
     return get_exposed_host(NOSCOPINST, mem);
 }
 
-cl_mem prl_mem_get_dev_mem(prl_mem mem) {
-    assert(mem);
-
-    mem->dev_exposed = true;
-    return mem->clmem;
-}
-
 // Change location of buffer without necessarily preserving its contents; if content preservation is required, prl_scop_host_to_device must have been called first
 static void ensure_to_device(prl_scop_instance scopinst, prl_mem mem) {
     assert(scopinst);
     assert(mem);
+    host_faults_apply(mem);
 
-    if (mem->loc == loc_dev || mem->loc == loc_transferring_to_dev) {
+    if (mem->loc == loc_dev || mem->loc == loc_shared || mem->loc == loc_transferring_to_dev) {
         // Nothing to do
         return;
     }
 
     ensure_dev_allocated(scopinst, mem);
     assert(is_valid_loc(mem));
+    mem_dev_changed(mem);
 
     switch (mem->type) {
     case alloc_type_rwbuf:
@@ -3300,6 +6412,7 @@ static void ensure_to_device(prl_scop_instance scopinst, prl_mem mem) {
         case loc_none:
             // no transfer needed
             mem->loc = loc_dev;
+            dirty_invalidate(mem);
             break;
         default:
             // Unhandled, should never happen
@@ -3314,7 +6427,7 @@ static void ensure_to_device(prl_scop_instance scopinst, prl_mem mem) {
             break;
         case loc_host: { //TODO: Transfer not necessary; data not needed to be preserved
             cl_event event = NULL;
-            clEnqueueUnmapMemObject_checked(scopinst, scopinst->queue, mem->clmem, mem->host_mem, 0, NULL, (need_events() || is_blocking()) ? &event : NULL);
+            clEnqueueUnmapMemObject_checked(scopinst, scopinst->queue, mem->clmem, mem->host_mem, 0, NULL, (need_events(scopinst) || is_blocking()) ? &event : NULL);
             if (is_blocking()) {
                 clWaitForEvent_checked(scopinst, event);
                 mem->loc = loc_dev;
@@ -3341,6 +6454,50 @@ static void ensure_to_device(prl_scop_instance scopinst, prl_mem mem) {
     assert(is_valid_loc(mem));
 }
 
+// Upload only the pages that have been written to since the last transfer.
+// Returns false if nothing had to be transferred; otherwise the event of the last transfer is returned in last_event.
+static bool write_dirty_pages(prl_scop_instance scopinst, prl_mem mem, cl_event *last_event) {
+    assert(mem->dirty_baseline);
+    assert(!mem->rect);
+
+    size_t page_size = global_state.page_size;
+    size_t pages = mem_page_count(mem);
+    size_t written = 0;
+    cl_event event = NULL;
+    bool any = false;
+
+    size_t i = 0;
+    while (i < pages) {
+        if (!mem->dirty_pages[i]) {
+            i += 1;
+            continue;
+        }
+
+        // Find the end of this run of dirty pages, bridging small gaps of clean pages
+        size_t end = i + 1;
+        for (size_t j = end; j < pages && j <= end + DIRTY_MERGE_GAP_PAGES; j += 1) {
+            if (mem->dirty_pages[j])
+                end = j + 1;
+        }
+
+        size_t offset = i * page_size;
+        size_t size = ((end * page_size < mem->size) ? end * page_size : mem->size) - offset;
+        if (any)
+            push_back_event(scopinst, event, mem, NULL, is_blocking());
+        event = NULL;
+        clEnqueueWriteBuffer_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), offset, size, (char *)mem->host_mem + offset, 0, NULL, need_events(scopinst) ? &event : NULL);
+        written += size;
+        any = true;
+
+        i = end;
+    }
+
+    count_transfer(scopinst, mem, dir_to_device, written);
+    add_counter(scopinst, counter_bytes_dirty_skipped, mem->size - written);
+    *last_event = event;
+    return any;
+}
+
 static bool is_mem_available_on_dev(prl_mem mem) {
     return (mem->loc & loc_bit_dev_is_current) || (mem->loc & loc_bit_transferring_host_to_dev);
 }
@@ -3349,7 +6506,46 @@ static bool is_mem_available_on_host(prl_mem mem) {
     return (mem->loc & loc_bit_host_is_current);
 }
 
-void prl_scop_host_to_device(prl_scop_instance scopinst, prl_mem mem) {
+// Drop the reference to a dedup cache buffer; the mem gets a device buffer of its own on the next upload
+static void dedup_detach(prl_scop_instance scopinst, prl_mem mem) {
+    if (!mem->dev_shared)
+        return;
+
+    dedup_drop_user(mem);
+    clReleaseMemObject_checked(scopinst, mem->clmem);
+    mem->clmem = NULL;
+    mem->dev_owning = false;
+    mem->dev_shared = false;
+    if (mem->loc & (loc_bit_dev_is_current | loc_bit_transferring_host_to_dev)) {
+        mem->loc = loc_host;
+        mem->transferevent = NULL;
+    }
+    dirty_invalidate(mem);
+}
+
+// Copy-on-write: give the mem a device buffer of its own before it is modified or exposed
+static void dedup_unshare(prl_scop_instance scopinst, prl_mem mem) {
+    if (!mem->dev_shared)
+        return;
+
+    dedup_drop_user(mem);
+    cl_mem shared = mem->clmem;
+    mem->clmem = NULL;
+    mem->dev_owning = false;
+    mem->dev_shared = false;
+    ensure_dev_allocated(scopinst, mem);
+
+    if (mem->loc & (loc_bit_dev_is_current | loc_bit_transferring_host_to_dev)) {
+        cl_command_queue queue = acquire_blocking_queue(scopinst);
+        clEnqueueCopyBuffer_checked(scopinst, queue, shared, mem->clmem, 0, 0, mem->size, 0, NULL, NULL);
+        if (!scopinst)
+            clFinish_checked(scopinst, queue); // Used outside of PRL's queues
+        release_blocking_queue(scopinst, queue);
+    }
+    clReleaseMemObject_checked(scopinst, shared);
+}
+
+static void mem_upload(prl_scop_instance scopinst, prl_mem mem) {
     assert(scopinst);
     assert(mem);
     assert(is_valid_loc(mem));
@@ -3359,6 +6555,10 @@ void prl_scop_host_to_device(prl_scop_instance scopinst, prl_mem mem) {
         return;
     }
 
+    // Never overwrite a buffer other mems might use
+    dedup_detach(scopinst, mem);
+    mem_dev_changed(mem);
+
     // If we did not allocate a device-side buffer yet, do it now
     ensure_dev_allocated(scopinst, mem);
     assert(is_valid_loc(mem));
@@ -3367,9 +6567,22 @@ void prl_scop_host_to_device(prl_scop_instance scopinst, prl_mem mem) {
     case alloc_type_rwbuf: {
         if (mem->loc & loc_bit_host_is_current) {
             cl_event event = NULL;
-            clEnqueueWriteBuffer_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), 0, mem->size, mem->host_mem, 0, NULL, need_events() ? &event : NULL);
-            if (is_blocking()) {
-                mem->loc = loc_dev;
+            bool transferring = true;
+            if (mem->dirty_baseline) {
+                transferring = write_dirty_pages(scopinst, mem, &event);
+            } else if (mem->rect) {
+                clEnqueueWriteBufferRect_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), mem->rect_origin, mem->rect_origin, mem->rect_region, mem->rect_row_pitch, mem->rect_slice_pitch, mem->rect_row_pitch, mem->rect_slice_pitch, mem->host_mem, 0, NULL, need_events(scopinst) ? &event : NULL);
+                count_transfer(scopinst, mem, dir_to_device, mem->rect_region[0] * mem->rect_region[1] * mem->rect_region[2]);
+            } else {
+                clEnqueueWriteBuffer_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), 0, mem->size, mem->host_mem, 0, NULL, need_events(scopinst) ? &event : NULL);
+                count_transfer(scopinst, mem, dir_to_device, mem->size);
+            }
+            dirty_rebase(mem);
+
+            if (!transferring) {
+                mem->loc = loc_shared;
+            } else if (is_blocking()) {
+                mem->loc = loc_shared;
                 push_back_event(scopinst, event, mem, NULL, true);
             } else {
                 mem->transferevent = event;
@@ -3383,7 +6596,8 @@ void prl_scop_host_to_device(prl_scop_instance scopinst, prl_mem mem) {
 
     case alloc_type_map: {
         cl_event event = NULL;
-        clEnqueueUnmapMemObject_checked(scopinst, scopinst->queue, mem->clmem, mem->host_mem, 0, NULL, (need_events() || is_blocking()) ? &event : NULL);
+        clEnqueueUnmapMemObject_checked(scopinst, scopinst->queue, mem->clmem, mem->host_mem, 0, NULL, (need_events(scopinst) || is_blocking()) ? &event : NULL);
+        count_transfer(scopinst, mem, dir_to_device, mem->size);
         if (is_blocking()) {
             clWaitForEvent_checked(scopinst, event);
             mem->loc = loc_dev;
@@ -3394,40 +6608,195 @@ void prl_scop_host_to_device(prl_scop_instance scopinst, prl_mem mem) {
         }
     } break;
 
-    case alloc_type_dev_only:
+    case alloc_type_dev_only:
+        // Nothing to do
+        break;
+
+    case alloc_type_host_only:
+    case alloc_type_none:
+    case alloc_type_svm:
+        assert(false);
+    }
+
+    assert(is_valid_loc(mem));
+    assert(mem->loc == loc_dev || mem->loc == loc_shared || mem->loc == loc_transferring_to_dev);
+}
+
+static void flush_pending_upload(prl_mem mem) {
+    prl_scop_instance scopinst = mem->upload_pending;
+    if (!scopinst)
+        return;
+
+    mem->upload_pending = NULL;
+    mem_upload(scopinst, mem);
+}
+
+static struct prl_dedup_entry *dedup_lookup(const uint64_t hash[2], size_t size) {
+    for (int i = 0; i < DEDUP_CACHE_ENTRIES; i += 1) {
+        struct prl_dedup_entry *entry = &global_state.dedup_cache[i];
+        if (entry->clmem && entry->size == size && entry->hash[0] == hash[0] && entry->hash[1] == hash[1])
+            return entry;
+    }
+    return NULL;
+}
+
+// Free or least recently used entry without users; NULL if all are in use
+static struct prl_dedup_entry *dedup_victim() {
+    for (int i = 0; i < DEDUP_CACHE_ENTRIES; i += 1) {
+        struct prl_dedup_entry *entry = &global_state.dedup_cache[i];
+        if (!entry->clmem)
+            return entry;
+    }
+    return dedup_lru_unused();
+}
+
+// Pending upload of a buffer that the kernel only reads; use a device buffer with the same content if there is one.
+// Returns false if the buffer is not eligible and has to be uploaded normally.
+static bool dedup_upload(prl_scop_instance scopinst, prl_mem mem) {
+    if (!global_state.config.dedup_uploads)
+        return false;
+    if (mem->type != alloc_type_rwbuf || mem->rect || mem->dirty_baseline || mem->size == 0 || !(mem->loc & loc_bit_host_is_current))
+        return false;
+    if (mem->clmem && mem->dev_owning && !mem->dev_shared)
+        return false; // Keep its own device buffer
+
+    mem->upload_pending = NULL;
+
+    uint64_t hash[2];
+    content_hash(scopinst, mem->host_mem, mem->size, hash);
+
+    dedup_detach(scopinst, mem);
+    if (mem->clmem && !mem->dev_owning)
+        mem->clmem = NULL; // Kept by PRL_SCOP_REPLAY for this mem, which must not end up in the cache
+
+    global_state.dedup_clock += 1;
+    struct prl_dedup_entry *entry = dedup_lookup(hash, mem->size);
+    if (entry) {
+        entry->last_use = global_state.dedup_clock;
+        if (entry->ready && entry->queue != scopinst->queue) {
+            // Other queues are not ordered after the upload
+            clWaitForEvent_checked(scopinst, entry->ready);
+            clReleaseEvent_checked(scopinst, entry->ready);
+            entry->ready = NULL;
+        }
+        entry->users += 1;
+        clRetainMemObject_checked(scopinst, entry->clmem);
+        mem->clmem = entry->clmem;
+        mem->dev_owning = true;
+        mem->dev_exposed = false;
+        mem->dev_shared = true;
+        mem->loc = loc_shared;
+        mem_dev_changed(mem);
+        dirty_rebase(mem);
+        add_counter(scopinst, counter_bytes_dedup_skipped, mem->size);
+        return true;
+    }
+
+    mem_upload(scopinst, mem);
+
+    // Offer the device buffer to later uploads of the same content; the cache owns it now and it is evicted only when no mem uses it anymore
+    entry = dedup_victim();
+    if (!entry)
+        return true; // Every cached buffer is in use; the mem keeps its buffer
+    if (entry->clmem)
+        dedup_entry_release(scopinst, entry);
+    if (mem->dev_resident)
+        lru_remove(mem);
+    clRetainMemObject_checked(scopinst, mem->clmem);
+    entry->hash[0] = hash[0];
+    entry->hash[1] = hash[1];
+    entry->size = mem->size;
+    entry->clmem = mem->clmem;
+    entry->last_use = global_state.dedup_clock;
+    entry->users = 1;
+    entry->ready = clEnqueueMarker_checked(scopinst, scopinst->queue);
+    entry->queue = scopinst->queue;
+    global_state.dev_resident_bytes += entry->size;
+    mem->dev_shared = true;
+    return true;
+}
+
+void prl_scop_host_to_device(prl_scop_instance scopinst, prl_mem mem) {
+    assert(scopinst);
+    assert(mem);
+    assert(is_valid_loc(mem));
+
+    replay_mem_cmd(scopinst, scop_cmd_host_to_device, mem);
+    mem_wait_pending(mem); // Might not have been looked up by prl_scop_get_mem in this instance
+
+    if (is_oversized(mem)) {
+        // Kernels stream it from the host buffer
+        return;
+    }
+
+    if (is_mem_available_on_dev(mem)) {
         // Nothing to do
-        break;
+        return;
+    }
 
-    case alloc_type_host_only:
-    case alloc_type_none:
-    case alloc_type_svm:
-        assert(false);
+    if (mem->type == alloc_type_rwbuf && (mem->loc & loc_bit_host_is_current)) {
+        // Whether the transfer is needed is known when a kernel uses the buffer
+        assert(!mem->upload_pending || mem->upload_pending == scopinst);
+        if (!mem->scopinst && !is_mem_registered(scopinst, mem))
+            push_back_mem(scopinst, mem); // prl_scop_leave resets upload_pending
+        mem->upload_pending = scopinst;
+        return;
     }
 
-    assert(is_valid_loc(mem));
-    assert(mem->loc == loc_dev || mem->loc == loc_transferring_to_dev);
+    mem_upload(scopinst, mem);
+}
+
+cl_mem prl_mem_get_dev_mem(prl_mem mem) {
+    assert(mem);
+
+    mem_wait_pending(mem);
+    flush_pending_upload(mem);
+    dedup_unshare(NOSCOPINST, mem);
+    mem->dev_exposed = true;
+    return mem->clmem;
 }
 
 void prl_scop_device_to_host(prl_scop_instance scopinst, prl_mem mem) {
     assert(mem);
     assert(is_valid_loc(mem));
 
+    replay_mem_cmd(scopinst, scop_cmd_device_to_host, mem);
+    mem_wait_pending(mem);
+
     if (!mem->host_readable || !mem->transfer_to_host) {
         // This mem is configured to not transfer the data
         return;
     }
 
-    if (mem->loc == loc_host || mem->loc == loc_transferring_to_host) {
+    if ((mem->loc & loc_bit_host_is_current) || mem->loc == loc_transferring_to_host) {
         // Already on host
         return;
     }
 
+    if (mem->type == alloc_type_rwbuf && mem->loc == loc_transferring_to_dev) {
+        // No kernel has written to the device buffer (see mem_dev_write); the host buffer still is current
+        return;
+    }
+
+    if (is_lazy_readback_applicable(mem)) {
+        defer_readback(scopinst, mem);
+        return;
+    }
+
     switch (mem->type) {
     case alloc_type_rwbuf: {
         cl_event event = NULL;
-        clEnqueueReadBuffer_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), 0, mem->size, mem->host_mem, 0, NULL, need_events() ? &event : NULL);
+        dirty_invalidate(mem); // The host buffer is written to
+        if (mem->rect) {
+            clEnqueueReadBufferRect_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), mem->rect_origin, mem->rect_origin, mem->rect_region, mem->rect_row_pitch, mem->rect_slice_pitch, mem->rect_row_pitch, mem->rect_slice_pitch, mem->host_mem, 0, NULL, need_events(scopinst) ? &event : NULL);
+            count_transfer(scopinst, mem, dir_to_host, mem->rect_region[0] * mem->rect_region[1] * mem->rect_region[2]);
+        } else {
+            clEnqueueReadBuffer_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), 0, mem->size, mem->host_mem, 0, NULL, need_events(scopinst) ? &event : NULL);
+            count_transfer(scopinst, mem, dir_to_host, mem->size);
+        }
         if (is_blocking()) {
-            mem->loc = loc_host;
+            dirty_rebase(mem);
+            mem->loc = loc_after_readback(mem);
             push_back_event(scopinst, event, mem, NULL, true);
         } else {
             mem->loc = loc_transferring_to_host;
@@ -3437,7 +6806,8 @@ void prl_scop_device_to_host(prl_scop_instance scopinst, prl_mem mem) {
     } break;
     case alloc_type_map: {
         cl_event event = NULL;
-        void *mappedptr = clEnqueueMapBuffer_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), (mem->dev_readable ? CL_MAP_READ : 0) | (mem->dev_writable ? CL_MAP_WRITE : 0), 0, mem->size, 0, NULL, need_events() ? &event : NULL);
+        void *mappedptr = clEnqueueMapBuffer_checked(scopinst, scopinst->queue, mem->clmem, is_blocking(), (mem->dev_readable ? CL_MAP_READ : 0) | (mem->dev_writable ? CL_MAP_WRITE : 0), 0, mem->size, 0, NULL, need_events(scopinst) ? &event : NULL);
+        count_transfer(scopinst, mem, dir_to_host, mem->size);
         assert(mappedptr == mem->host_mem && "clEnqueueMapBuffer should always return the same pointer");
         if (is_blocking()) {
             assert(event);
@@ -3458,11 +6828,446 @@ void prl_scop_device_to_host(prl_scop_instance scopinst, prl_mem mem) {
     case alloc_type_svm:
         assert(false);
     }
-    assert(mem->loc == loc_host || mem->loc == loc_transferring_to_host);
+    assert((mem->loc & loc_bit_host_is_current) || mem->loc == loc_transferring_to_host);
     assert(is_valid_loc(mem));
 }
 
-void prl_scop_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[static const restrict work_dims], int block_dims, size_t block_size[static const restrict block_dims], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+// clSetKernelArg, unless the same value has already been set for this argument
+static void set_kernel_arg_cached(prl_scop_instance scopinst, prl_kernel kernel, size_t arg_index, size_t arg_size, const void *arg_value, bool is_clmem) {
+    if (arg_index >= kernel->args_cache_size) {
+        size_t new_size = arg_index + 1;
+        kernel->args_cache = realloc_checked(scopinst, kernel->args_cache, new_size * sizeof *kernel->args_cache);
+        memset(&kernel->args_cache[kernel->args_cache_size], 0, (new_size - kernel->args_cache_size) * sizeof *kernel->args_cache);
+        kernel->args_cache_size = new_size;
+    }
+
+    struct prl_kernel_arg_cache *cache = &kernel->args_cache[arg_index];
+    if (!arg_value) {
+        // __local memory argument; only its size is set
+        clSetKernelArg_checked(scopinst, kernel->kernel, arg_index, arg_size, arg_value);
+        kernel->args_gen += 1;
+        cache->valid = false;
+        return;
+    }
+
+    if (cache->valid && cache->size == arg_size && memcmp(cache->data, arg_value, arg_size) == 0 &&
+        (!is_clmem || cache->clmem_release_gen == global_state.clmem_release_gen)) {
+        add_counter(scopinst, counter_setarg_skipped, 1);
+        return;
+    }
+
+    clSetKernelArg_checked(scopinst, kernel->kernel, arg_index, arg_size, arg_value);
+    kernel->args_gen += 1;
+
+    if (cache->size != arg_size) {
+        free_checked(scopinst, cache->data);
+        cache->data = malloc_checked(scopinst, arg_size);
+        cache->size = arg_size;
+    }
+    memcpy(cache->data, arg_value, arg_size);
+    cache->clmem_release_gen = global_state.clmem_release_gen;
+    cache->valid = true;
+}
+
+static struct prl_scop_cmd *record_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[static const restrict work_dims], int block_dims, size_t block_size[static const restrict block_dims], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    prl_scop scop = scopinst->scop;
+
+    struct prl_scop_cmd_arg *cmdargs = malloc_checked(scopinst, n_args * sizeof *cmdargs);
+    for (size_t i = 0; i < n_args; i += 1) {
+        cmdargs[i].type = args[i].type;
+        cmdargs[i].size = 0;
+        cmdargs[i].mem.mem_cmd = NO_CMD;
+        cmdargs[i].mem.gmem = NULL;
+        cmdargs[i].data = NULL;
+        cmdargs[i].clmem = NULL;
+        if (args[i].type == prl_kernel_call_arg_mem)
+            cmdargs[i].mem = record_memref(scop, args[i].mem);
+        else if (args[i].type == prl_kernel_call_arg_value)
+            cmdargs[i].size = args[i].size;
+    }
+
+    struct prl_scop_cmd *cmd = record_cmd(scopinst, scop_cmd_call);
+    cmd->kernel = kernel;
+    cmd->work_dims = work_dims;
+    memcpy(cmd->work_size, work_size, work_dims * sizeof *work_size);
+    cmd->block_dims = block_dims;
+    memcpy(cmd->block_size, block_size, block_dims * sizeof *block_size);
+    cmd->n_args = n_args;
+    cmd->args = cmdargs;
+    return cmd;
+}
+
+// The recorded call if it matches
+static struct prl_scop_cmd *replay_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[static const restrict work_dims], int block_dims, size_t block_size[static const restrict block_dims], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    prl_scop scop = scopinst->scop;
+
+    struct prl_scop_cmd *cmd = replay_cmd(scopinst, scop_cmd_call);
+    if (!cmd)
+        return NULL;
+
+    bool matches = cmd->kernel == kernel && cmd->work_dims == work_dims && cmd->block_dims == block_dims && cmd->n_args == n_args &&
+                   memcmp(cmd->work_size, work_size, work_dims * sizeof *work_size) == 0 &&
+                   memcmp(cmd->block_size, block_size, block_dims * sizeof *block_size) == 0;
+    for (size_t i = 0; matches && i < n_args; i += 1) {
+        struct prl_scop_cmd_arg *cmdarg = &cmd->args[i];
+        if (cmdarg->type != args[i].type)
+            matches = false;
+        else if (args[i].type == prl_kernel_call_arg_mem)
+            matches = replay_memref_matches(scop, &cmdarg->mem, args[i].mem);
+        else if (args[i].type == prl_kernel_call_arg_value)
+            matches = cmdarg->size == args[i].size;
+    }
+
+    if (!matches) {
+        replay_diverged(scopinst);
+        return NULL;
+    }
+    return cmd;
+}
+
+static bool is_streamed_arg(struct prl_kernel_call_arg *arg) {
+    return arg->type == prl_kernel_call_arg_mem && arg->item_size > 0;
+}
+
+// Make the buffer of a kernel argument available on the device
+static void prepare_mem_arg(prl_scop_instance scopinst, struct prl_kernel_call_arg *arg) {
+    prl_mem mem = arg->mem;
+    assert(mem);
+    mem_wait_pending(mem);
+    scop_pin_mem(scopinst, mem); // Before other arguments might cause evictions
+    if (mem->upload_pending) {
+        assert(mem->upload_pending == scopinst);
+        if (arg->access == prl_kernel_call_arg_write_discard) {
+            mem->upload_pending = NULL;
+            add_counter(scopinst, counter_bytes_discard_skipped, mem->size);
+        } else if (arg->access != prl_kernel_call_arg_read || !dedup_upload(scopinst, mem)) {
+            flush_pending_upload(mem);
+        }
+    }
+    ensure_to_device(scopinst, mem);
+    lru_touch(mem);
+    if (mem->dev_writable && arg->access != prl_kernel_call_arg_read) {
+        dedup_unshare(scopinst, mem);
+        mem_dev_write(mem); // Kernel might change the device buffer
+    }
+}
+
+// Set the kernel arguments and make the buffers available on the device; with streamed, the streamed buffers and chunk offsets are left to the caller
+static void set_call_args(prl_scop_instance scopinst, prl_kernel kernel, size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args], bool streamed) {
+    for (int i = 0; i < n_args; i += 1) {
+        struct prl_kernel_call_arg *arg = &args[i];
+
+        switch (arg->type) {
+        case prl_kernel_call_arg_value:
+            set_kernel_arg_cached(scopinst, kernel, i, arg->size, arg->data, false);
+            break;
+        case prl_kernel_call_arg_chunk_offset:
+            if (!streamed) {
+                cl_ulong offset = 0;
+                set_kernel_arg_cached(scopinst, kernel, i, sizeof offset, &offset, false);
+            }
+            break;
+        case prl_kernel_call_arg_mem:
+            if (streamed && is_streamed_arg(arg))
+                break;
+            prepare_mem_arg(scopinst, arg);
+            set_kernel_arg_cached(scopinst, kernel, i, sizeof(cl_mem), &arg->mem->clmem, true);
+            break;
+        }
+    }
+}
+
+// Remember the arguments that have been set for the next instance
+static void replay_remember_args(prl_scop_instance scopinst, prl_kernel kernel, struct prl_scop_cmd *cmd, size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    for (size_t i = 0; i < n_args; i += 1) {
+        struct prl_kernel_call_arg *arg = &args[i];
+        struct prl_scop_cmd_arg *cmdarg = &cmd->args[i];
+        if (arg->type == prl_kernel_call_arg_value && arg->data) {
+            if (!cmdarg->data)
+                cmdarg->data = malloc_checked(scopinst, arg->size);
+            memcpy(cmdarg->data, arg->data, arg->size);
+        } else if (arg->type == prl_kernel_call_arg_mem) {
+            cmdarg->clmem = arg->mem->clmem;
+        }
+    }
+    cmd->args_set = true;
+    cmd->args_gen = kernel->args_gen;
+    cmd->args_release_gen = global_state.clmem_release_gen;
+}
+
+// Replaying and no other call has set the kernel's arguments since the previous instance; only set those that changed
+static void replay_patch_args(prl_scop_instance scopinst, prl_kernel kernel, struct prl_scop_cmd *cmd, size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    assert(cmd->args_set && cmd->args_gen == kernel->args_gen);
+
+    for (int i = 0; i < n_args; i += 1) {
+        struct prl_kernel_call_arg *arg = &args[i];
+        struct prl_scop_cmd_arg *cmdarg = &cmd->args[i];
+
+        switch (arg->type) {
+        case prl_kernel_call_arg_value:
+            // __local memory only has a size, which matched the recording
+            if (arg->data && (!cmdarg->data || memcmp(cmdarg->data, arg->data, arg->size) != 0)) {
+                set_kernel_arg_cached(scopinst, kernel, i, arg->size, arg->data, false);
+                if (!cmdarg->data)
+                    cmdarg->data = malloc_checked(scopinst, arg->size);
+                memcpy(cmdarg->data, arg->data, arg->size);
+            }
+            break;
+        case prl_kernel_call_arg_chunk_offset:
+            break; // Still 0
+        case prl_kernel_call_arg_mem: {
+            prl_mem mem = arg->mem;
+            prepare_mem_arg(scopinst, arg);
+            // A released cl_mem's handle might have been reused
+            if (mem->clmem != cmdarg->clmem || global_state.clmem_release_gen != cmd->args_release_gen) {
+                set_kernel_arg_cached(scopinst, kernel, i, sizeof(cl_mem), &mem->clmem, true);
+                cmdarg->clmem = mem->clmem;
+            }
+        } break;
+        }
+    }
+    cmd->args_gen = kernel->args_gen;
+    cmd->args_release_gen = global_state.clmem_release_gen;
+}
+
+// The command of the call, if recording or replaying it
+static struct prl_scop_cmd *record_or_replay_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[static const restrict work_dims], int block_dims, size_t block_size[static const restrict block_dims], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    switch (scopinst->replay) {
+    case replay_recording:
+        return record_call(scopinst, kernel, work_dims, work_size, block_dims, block_size, n_args, args);
+    case replay_replaying:
+        return replay_call(scopinst, kernel, work_dims, work_size, block_dims, block_size, n_args, args);
+    default:
+        return NULL;
+    }
+}
+
+// Work-groups that are not a multiple of the preferred size leave SIMD lanes unused (PRL_ADVISE)
+static void check_work_group_size(prl_scop_instance scopinst, prl_kernel kernel, int dims, const size_t block_items[]) {
+    if (!kernel->preferred_wg_multiple) {
+        clGetKernelWorkGroupInfo_checked(scopinst, kernel->kernel, global_state.device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof kernel->preferred_wg_multiple, &kernel->preferred_wg_multiple, NULL);
+        if (!kernel->preferred_wg_multiple)
+            kernel->preferred_wg_multiple = 1;
+    }
+
+    size_t wg_size = 1;
+    for (int i = 0; i < dims; i += 1)
+        wg_size *= block_items[i];
+    if (wg_size % kernel->preferred_wg_multiple) {
+        kernel->misaligned_wg_size = wg_size;
+        kernel->misaligned_launches += 1;
+    }
+}
+
+// Launch the kernel, split into config.launch_slices launches along the outermost dimension if it is sliceable; every slice consists of whole work groups
+static void enqueue_kernel(prl_scop_instance scopinst, prl_kernel kernel, int dims, const size_t work_offset[], const size_t work_items[], const size_t block_items[]) {
+    if (global_state.config.advise)
+        check_work_group_size(scopinst, kernel, dims, block_items);
+
+    size_t slice_offset[3];
+    size_t slice_items[3];
+    for (int i = 0; i < dims; i += 1) {
+        slice_offset[i] = work_offset ? work_offset[i] : 0;
+        slice_items[i] = work_items[i];
+    }
+
+    size_t n_blocks = (work_items[0] + block_items[0] - 1) / block_items[0];
+    // get_group_id, get_num_groups and get_global_size are relative to a slice
+    size_t slices = kernel->sliceable ? global_state.config.launch_slices : 1;
+    if (slices < 1)
+        slices = 1;
+    if (slices > n_blocks)
+        slices = (n_blocks > 0) ? n_blocks : 1;
+    size_t slice_blocks = (n_blocks + slices - 1) / slices;
+
+    for (size_t first = 0; first < work_items[0]; first += slice_blocks * block_items[0]) {
+        slice_offset[0] = (work_offset ? work_offset[0] : 0) + first;
+        slice_items[0] = work_items[0] - first;
+        if (slice_items[0] > slice_blocks * block_items[0])
+            slice_items[0] = slice_blocks * block_items[0];
+
+        cl_event event = NULL;
+        kernel->launches += 1;
+        clEnqueueNDRangeKernel_checked(scopinst, scopinst->queue, kernel->kernel, dims, (work_offset || first > 0) ? slice_offset : NULL, slice_items, block_items, 0, NULL,
+                                       (need_events(scopinst) || is_blocking()) ? &event : NULL);
+        if (is_blocking()) {
+            clWaitForEvent_checked(scopinst, event);
+            push_back_event(scopinst, event, NULL, kernel, true);
+        } else {
+            push_back_event(scopinst, event, NULL, kernel, false);
+        }
+    }
+}
+
+static bool is_memo_output(struct prl_kernel_call_arg *arg) {
+    return arg->type == prl_kernel_call_arg_mem && (arg->access == prl_kernel_call_arg_write || arg->access == prl_kernel_call_arg_write_discard);
+}
+
+static bool is_memo_applicable(prl_kernel kernel, size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    if (!kernel->pure || global_state.memo_size == 0)
+        return false;
+
+    bool any_output = false;
+    for (size_t i = 0; i < n_args; i += 1) {
+        struct prl_kernel_call_arg *arg = &args[i];
+        if (arg->type != prl_kernel_call_arg_mem)
+            continue;
+        if (arg->access == prl_kernel_call_arg_readwrite)
+            return false; // The result would depend on the output's previous content
+        if (is_memo_output(arg)) {
+            if (arg->mem->type != alloc_type_rwbuf)
+                return false;
+            any_output = true;
+        }
+    }
+    return any_output;
+}
+
+// Fingerprint of everything a pure kernel's result depends on
+static void memo_key(prl_scop_instance scopinst, prl_kernel kernel, int dims, const size_t work_offset[], const size_t work_items[], const size_t block_items[], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args], uint64_t key[2]) {
+    size_t n_words = 2 + 3 * dims + 4 * n_args;
+    uint64_t *words = malloc_checked(scopinst, n_words * sizeof *words);
+    size_t n = 0;
+
+    words[n++] = (uintptr_t)kernel;
+    words[n++] = dims;
+    for (int d = 0; d < dims; d += 1) {
+        words[n++] = work_offset ? work_offset[d] : 0;
+        words[n++] = work_items[d];
+        words[n++] = block_items[d];
+    }
+
+    for (size_t i = 0; i < n_args; i += 1) {
+        struct prl_kernel_call_arg *arg = &args[i];
+        uint64_t hash[2] = {0, 0};
+
+        switch (arg->type) {
+        case prl_kernel_call_arg_value:
+            if (arg->data)
+                dedup_hash(arg->data, arg->size, hash);
+            else
+                hash[0] = arg->size; // __local memory
+            break;
+        case prl_kernel_call_arg_chunk_offset:
+            break;
+        case prl_kernel_call_arg_mem: {
+            prl_mem mem = arg->mem;
+            if (is_memo_output(arg)) {
+                hash[0] = mem->size;
+            } else if (mem->host_mem && (mem->loc & loc_bit_host_is_current) && !mem->host_lazy) {
+                // Also matches a different buffer with the same content
+                content_hash(scopinst, mem->host_mem, mem->size, hash);
+            } else {
+                hash[0] = (uintptr_t)mem;
+                hash[1] = mem->dev_version;
+            }
+        } break;
+        }
+
+        words[n++] = arg->type;
+        words[n++] = arg->access;
+        words[n++] = hash[0];
+        words[n++] = hash[1];
+    }
+    assert(n <= n_words);
+
+    dedup_hash(words, n * sizeof *words, key);
+    free_checked(scopinst, words);
+}
+
+// An entry for the same launch whose outputs have not been changed or evicted since
+static struct prl_memo_entry *memo_lookup(const uint64_t key[2], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    for (size_t i = 0; i < global_state.memo_size; i += 1) {
+        struct prl_memo_entry *entry = &global_state.memo[i];
+        if (!entry->valid || entry->key[0] != key[0] || entry->key[1] != key[1])
+            continue;
+
+        bool usable = true;
+        for (size_t k = 0; usable && k < entry->n_outputs; k += 1) {
+            prl_mem old = entry->outputs[k];
+            struct prl_kernel_call_arg *arg = &args[entry->output_args[k]];
+            if (old->dev_version != entry->output_versions[k] || !old->clmem || !(old->loc & loc_bit_dev_is_current))
+                usable = false;
+            else if (arg->mem != old && (arg->access != prl_kernel_call_arg_write_discard || arg->mem->size != old->size))
+                usable = false; // Elements the kernel does not write would differ
+        }
+        if (!usable) {
+            memo_entry_clear(NOSCOPINST, entry);
+            continue;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+// Instead of launching the kernel, copy the outputs of the remembered launch
+static void memo_reuse(prl_scop_instance scopinst, struct prl_memo_entry *entry, size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    global_state.memo_clock += 1;
+    entry->last_use = global_state.memo_clock;
+
+    for (size_t k = 0; k < entry->n_outputs; k += 1) {
+        prl_mem old = entry->outputs[k];
+        prl_mem mem = args[entry->output_args[k]].mem;
+        mem_wait_pending(mem);
+        scop_pin_mem(scopinst, mem);
+        mem->upload_pending = NULL;
+        if (mem == old)
+            continue; // Still has the result
+
+        // The source must not be evicted to make room for the destination
+        mem_wait_pending(old);
+        scop_pin_mem(scopinst, old);
+        dedup_detach(scopinst, mem);
+        ensure_dev_allocated(scopinst, mem);
+        cl_event event = NULL;
+        clEnqueueCopyBuffer_checked(scopinst, scopinst->queue, old->clmem, mem->clmem, 0, 0, mem->size, 0, NULL, need_events(scopinst) ? &event : NULL);
+        push_back_event(scopinst, event, mem, NULL, false);
+        mem_dev_write(mem);
+        mem->loc = loc_dev;
+        lru_touch(mem);
+    }
+}
+
+static void memo_record(prl_scop_instance scopinst, const uint64_t key[2], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    struct prl_memo_entry *entry = &global_state.memo[0];
+    for (size_t i = 0; i < global_state.memo_size; i += 1) {
+        struct prl_memo_entry *cand = &global_state.memo[i];
+        if (!cand->valid) {
+            entry = cand;
+            break;
+        }
+        if (cand->last_use < entry->last_use)
+            entry = cand;
+    }
+    memo_entry_clear(scopinst, entry);
+
+    size_t n_outputs = 0;
+    for (size_t i = 0; i < n_args; i += 1) {
+        if (is_memo_output(&args[i]))
+            n_outputs += 1;
+    }
+
+    global_state.memo_clock += 1;
+    entry->valid = true;
+    entry->key[0] = key[0];
+    entry->key[1] = key[1];
+    entry->last_use = global_state.memo_clock;
+    entry->n_outputs = n_outputs;
+    entry->output_args = malloc_checked(scopinst, n_outputs * sizeof *entry->output_args);
+    entry->outputs = malloc_checked(scopinst, n_outputs * sizeof *entry->outputs);
+    entry->output_versions = malloc_checked(scopinst, n_outputs * sizeof *entry->output_versions);
+    size_t k = 0;
+    for (size_t i = 0; i < n_args; i += 1) {
+        if (!is_memo_output(&args[i]))
+            continue;
+        entry->output_args[k] = i;
+        entry->outputs[k] = args[i].mem;
+        entry->output_versions[k] = args[i].mem->dev_version;
+        k += 1;
+    }
+}
+
+void prl_scop_call_offset(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_offset[], size_t work_size[], int block_dims, size_t block_size[], size_t n_args, struct prl_kernel_call_arg args[]) {
     assert(scopinst);
     assert(kernel);
     assert(work_dims > 0);
@@ -3473,22 +7278,17 @@ void prl_scop_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims,
     assert(block_size);
     assert(work_dims == block_dims);
 
-    for (int i = 0; i < n_args; i += 1) {
-        struct prl_kernel_call_arg *arg = &args[i];
-
-        switch (arg->type) {
-        case prl_kernel_call_arg_value:
-            clSetKernelArg_checked(scopinst, kernel->kernel, i, arg->size, arg->data);
-            break;
-        case prl_kernel_call_arg_mem: {
-            assert(arg->mem);
-            ensure_to_device(scopinst, arg->mem);
-            clSetKernelArg_checked(scopinst, kernel->kernel, i, sizeof(cl_mem), &arg->mem->clmem);
-        } break;
+    for (size_t i = 0; i < n_args; i += 1) {
+        if (args[i].type == prl_kernel_call_arg_mem && is_oversized(args[i].mem)) {
+            // Segment the call such that every part of the buffer fits into a device buffer
+            assert(!work_offset && "Chunks of a segmented call count from 0");
+            prl_scop_call_streamed(scopinst, kernel, work_dims, work_size, block_dims, block_size, n_args, args, 0);
+            return;
         }
     }
 
-    int common_dims = (work_dims < block_dims) ? work_dims : block_dims;
+    struct prl_scop_cmd *cmd = record_or_replay_call(scopinst, kernel, work_dims, work_size, block_dims, block_size, n_args, args);
+
     int max_dims = (work_dims < block_dims) ? block_dims : work_dims;
 
     size_t work_items[3];
@@ -3498,14 +7298,222 @@ void prl_scop_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims,
         block_items[i] = (i < block_dims) ? block_size[i] : 1;
     }
 
-    cl_event event = NULL;
-    clEnqueueNDRangeKernel_checked(scopinst, scopinst->queue, kernel->kernel, max_dims, NULL, work_items, block_items, 0, NULL,
-                                   (need_events() || is_blocking()) ? &event : NULL);
-    if (is_blocking()) {
-        clWaitForEvent_checked(scopinst, event);
-        push_back_event(scopinst, event, NULL, kernel, true);
+    bool memoizing = is_memo_applicable(kernel, n_args, args);
+    uint64_t key[2];
+    if (memoizing) {
+        memo_key(scopinst, kernel, max_dims, work_offset, work_items, block_items, n_args, args, key);
+        struct prl_memo_entry *entry = memo_lookup(key, n_args, args);
+        if (entry) {
+            add_counter(scopinst, counter_memo_hits, 1);
+            memo_reuse(scopinst, entry, n_args, args);
+            return;
+        }
+        add_counter(scopinst, counter_memo_misses, 1);
+    }
+
+    if (cmd && cmd->args_set && cmd->args_gen == kernel->args_gen) {
+        replay_patch_args(scopinst, kernel, cmd, n_args, args);
     } else {
+        set_call_args(scopinst, kernel, n_args, args, false);
+        if (cmd)
+            replay_remember_args(scopinst, kernel, cmd, n_args, args);
+    }
+    enqueue_kernel(scopinst, kernel, max_dims, work_offset, work_items, block_items);
+
+    if (memoizing)
+        memo_record(scopinst, key, n_args, args);
+}
+
+void prl_scop_call(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[static const restrict work_dims], int block_dims, size_t block_size[static const restrict block_dims], size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args]) {
+    prl_scop_call_offset(scopinst, kernel, work_dims, NULL, work_size, block_dims, block_size, n_args, args);
+}
+
+// Number of outermost items per chunk such that STREAM_SLOTS chunks of every streamed buffer fit into device memory along with the other buffers
+static size_t stream_chunk_items(size_t n_args, struct prl_kernel_call_arg args[static const restrict n_args], size_t block_items) {
+    cl_ulong avail = global_state.dev_global_mem_size / 2; // Leave room for other allocations
+    size_t item_bytes = 0;
+
+    for (size_t i = 0; i < n_args; i += 1) {
+        struct prl_kernel_call_arg *arg = &args[i];
+        if (arg->type != prl_kernel_call_arg_mem)
+            continue;
+        if (is_streamed_arg(arg)) {
+            item_bytes += arg->item_size;
+        } else {
+            avail -= (arg->mem->size < avail) ? arg->mem->size : avail;
+        }
+    }
+    assert(item_bytes > 0);
+
+    cl_ulong chunk_items = avail / (STREAM_SLOTS * item_bytes);
+    chunk_items -= chunk_items % block_items;
+    if (chunk_items < block_items)
+        chunk_items = block_items;
+    return chunk_items;
+}
+
+// Chunks are transferred directly from and to the host buffer; make it current
+static void stream_prepare(prl_scop_instance scopinst, prl_mem mem, bool written) {
+    assert(mem->type == alloc_type_rwbuf && "Only buffers with a host copy can be streamed");
+
+    mem_wait_pending(mem);
+    mem_event_finished(scopinst, mem);
+    mem->upload_pending = NULL; // Uploaded chunk by chunk
+    ensure_host_allocated(scopinst, mem);
+    if (mem->host_lazy) {
+        host_materialize(scopinst, mem);
+    } else if (mem->loc == loc_dev) {
+        clEnqueueReadBuffer_checked(scopinst, scopinst->queue, mem->clmem, CL_BLOCKING_TRUE, 0, mem->size, mem->host_mem, 0, NULL, NULL);
+        count_transfer(scopinst, mem, dir_to_host, mem->size);
+        dirty_rebase(mem);
+        mem->loc = loc_after_readback(mem);
+    }
+
+    // The device must be able to write into the host pages
+    if (written)
+        dirty_invalidate(mem);
+}
+
+void prl_scop_call_streamed(prl_scop_instance scopinst, prl_kernel kernel, int work_dims, size_t work_size[], int block_dims, size_t block_size[], size_t n_args, struct prl_kernel_call_arg args[], size_t chunk_items) {
+    assert(scopinst);
+    assert(kernel);
+    assert(work_dims > 0);
+    assert(work_dims <= 3);
+    assert(work_size);
+    assert(block_size);
+    assert(work_dims == block_dims);
+
+    size_t n_items = work_size[0];
+    size_t block_items = block_size[0];
+    bool any_streamed = false;
+    bool any_oversized = false;
+    for (size_t i = 0; i < n_args; i += 1) {
+        if (args[i].type != prl_kernel_call_arg_mem)
+            continue;
+        if (is_oversized(args[i].mem)) {
+            if (!is_streamed_arg(&args[i])) {
+                fprintf(stderr, "Buffer %s exceeds CL_DEVICE_MAX_MEM_ALLOC_SIZE, but the kernel argument has no item_size to segment it\n", args[i].mem->name ? args[i].mem->name : "(unnamed)");
+                exit(1);
+            }
+            any_oversized = true;
+        }
+        if (!is_streamed_arg(&args[i]))
+            continue;
+        assert(args[i].mem->size >= n_items * args[i].item_size);
+        any_streamed = true;
+    }
+
+    if (chunk_items == 0)
+        chunk_items = any_streamed ? stream_chunk_items(n_args, args, block_items) : n_items;
+    assert(chunk_items % block_items == 0);
+
+    // Every slot buffer must be a valid allocation
+    for (size_t i = 0; i < n_args; i += 1) {
+        if (!is_streamed_arg(&args[i]) || global_state.dev_max_alloc_size == 0)
+            continue;
+        size_t max_items = global_state.dev_max_alloc_size / args[i].item_size;
+        max_items -= max_items % block_items;
+        assert(max_items > 0 && "Not even one work group fits into a device buffer");
+        if (chunk_items > max_items)
+            chunk_items = max_items;
+    }
+
+    if (!any_streamed || (chunk_items >= n_items && !any_oversized)) {
+        // Everything fits at once
+        prl_scop_call(scopinst, kernel, work_dims, work_size, block_dims, block_size, n_args, args);
+        return;
+    }
+
+    record_or_replay_call(scopinst, kernel, work_dims, work_size, block_dims, block_size, n_args, args);
+    set_call_args(scopinst, kernel, n_args, args, true);
+
+    // Chunks run on the slot queues, which are not ordered with the SCoP's queue
+    clFinish_checked(scopinst, scopinst->queue);
+    for (size_t i = 0; i < n_args; i += 1) {
+        if (is_streamed_arg(&args[i]))
+            stream_prepare(scopinst, args[i].mem, args[i].access != prl_kernel_call_arg_read);
+    }
+
+    size_t n_chunks = (n_items + chunk_items - 1) / chunk_items;
+    size_t n_slots = (n_chunks < STREAM_SLOTS) ? n_chunks : STREAM_SLOTS;
+    cl_mem *slot_clmems = malloc_checked(scopinst, n_slots * n_args * sizeof *slot_clmems);
+    for (size_t slot = 0; slot < n_slots; slot += 1) {
+        if (!global_state.stream_queues[slot])
+            global_state.stream_queues[slot] = clCreateCommandQueue_checked(NOSCOPINST, global_state.context, global_state.device, any_gpu_profiling() ? CL_QUEUE_PROFILING_ENABLE : 0);
+        for (size_t i = 0; i < n_args; i += 1) {
+            slot_clmems[slot * n_args + i] = NULL;
+            if (is_streamed_arg(&args[i]))
+                slot_clmems[slot * n_args + i] = clCreateBuffer_checked(scopinst, global_state.context, CL_MEM_READ_WRITE, chunk_items * args[i].item_size, NULL);
+        }
+    }
+
+    size_t work_items[3];
+    size_t block_sizes[3];
+    for (int i = 0; i < work_dims; i += 1) {
+        work_items[i] = work_size[i];
+        block_sizes[i] = block_size[i];
+    }
+
+    // Each chunk's upload, kernel and read-back are ordered by the slot's in-order queue, as is the reuse of the slot's buffers by the chunk STREAM_SLOTS later.
+    // Commands of different slots may overlap.
+    for (size_t chunk = 0; chunk < n_chunks; chunk += 1) {
+        size_t first = chunk * chunk_items;
+        size_t items = (n_items - first < chunk_items) ? n_items - first : chunk_items;
+        size_t slot = chunk % n_slots;
+        cl_command_queue queue = global_state.stream_queues[slot];
+        cl_mem *clmems = &slot_clmems[slot * n_args];
+
+        for (size_t i = 0; i < n_args; i += 1) {
+            struct prl_kernel_call_arg *arg = &args[i];
+            if (arg->type == prl_kernel_call_arg_chunk_offset) {
+                cl_ulong offset = first;
+                set_kernel_arg_cached(scopinst, kernel, i, sizeof offset, &offset, false);
+                continue;
+            }
+            if (!is_streamed_arg(arg))
+                continue;
+
+            if (arg->access != prl_kernel_call_arg_write_discard) {
+                cl_event event = NULL;
+                clEnqueueWriteBuffer_checked(scopinst, queue, clmems[i], CL_BLOCKING_FALSE, 0, items * arg->item_size, (char *)arg->mem->host_mem + first * arg->item_size, 0, NULL, need_events(scopinst) ? &event : NULL);
+                count_transfer(scopinst, arg->mem, dir_to_device, items * arg->item_size);
+                push_back_event(scopinst, event, arg->mem, NULL, false);
+            }
+            set_kernel_arg_cached(scopinst, kernel, i, sizeof(cl_mem), &clmems[i], true);
+        }
+
+        cl_event event = NULL;
+        work_items[0] = items;
+        clEnqueueNDRangeKernel_checked(scopinst, queue, kernel->kernel, work_dims, NULL, work_items, block_sizes, 0, NULL, need_events(scopinst) ? &event : NULL);
         push_back_event(scopinst, event, NULL, kernel, false);
+        add_counter(scopinst, counter_streamed_chunks, 1);
+
+        for (size_t i = 0; i < n_args; i += 1) {
+            struct prl_kernel_call_arg *arg = &args[i];
+            if (!is_streamed_arg(arg) || arg->access == prl_kernel_call_arg_read)
+                continue;
+
+            cl_event event = NULL;
+            clEnqueueReadBuffer_checked(scopinst, queue, clmems[i], CL_BLOCKING_FALSE, 0, items * arg->item_size, (char *)arg->mem->host_mem + first * arg->item_size, 0, NULL, need_events(scopinst) ? &event : NULL);
+            count_transfer(scopinst, arg->mem, dir_to_host, items * arg->item_size);
+            push_back_event(scopinst, event, arg->mem, NULL, false);
+        }
+    }
+
+    for (size_t slot = 0; slot < n_slots; slot += 1)
+        clFinish_checked(scopinst, global_state.stream_queues[slot]);
+    for (size_t i = 0; i < n_slots * n_args; i += 1) {
+        if (slot_clmems[i])
+            clReleaseMemObject_checked(scopinst, slot_clmems[i]);
+    }
+    free_checked(scopinst, slot_clmems);
+
+    // Only the host buffer has the kernels' results
+    for (size_t i = 0; i < n_args; i += 1) {
+        if (is_streamed_arg(&args[i]) && args[i].access != prl_kernel_call_arg_read) {
+            args[i].mem->loc = loc_host;
+            mem_dev_changed(args[i].mem);
+        }
     }
 }
 
@@ -3515,6 +7523,21 @@ void prl_perf_reset() {
     free_checked(NOSCOPINST, global_state.bench_stats);
     global_state.bench_stats = NULL;
     global_state.bench_stats_size = 0;
+
+    for (prl_scop scop = global_state.scops; scop; scop = scop->next) {
+        memset(&scop->stat, 0, sizeof scop->stat);
+        scop->instances = 0;
+        scop->profiled_instances = 0;
+        memset(scop->window_entries, 0, sizeof scop->window_entries);
+        scop->window_instances = 0;
+        scop->window_profiled_instances = 0;
+    }
+    for (size_t i = 0; i < global_state.buffer_stats_size; i += 1) {
+        struct prl_buffer_stat *stat = global_state.buffer_stats[i];
+        char *name = stat->name;
+        memset(stat, 0, sizeof *stat);
+        stat->name = name;
+    }
 }
 
 void prl_perf_start() {
@@ -3525,12 +7548,7 @@ void prl_perf_start() {
 void prl_perf_stop() {
     prl_time_t bench_stop = timestamp_force();
     struct prl_stat diff_stat;
-    for (int i = 0; i < STAT_ENTRIES; i += 1) {
-        diff_stat.entries[i] = global_state.global_stat.entries[i] - global_state.prev_global_stat.entries[i];
-        assert(diff_stat.entries[i] >= 0);
-        diff_stat.counts[i] = global_state.global_stat.counts[i] - global_state.prev_global_stat.counts[i];
-        assert(diff_stat.counts[i] >= 0);
-    }
+    stat_diff(&diff_stat, &global_state.global_stat, &global_state.prev_global_stat);
     diff_stat.entries[stat_cpu_bench] = bench_stop - global_state.bench_start;
     diff_stat.counts[stat_cpu_bench] = 1;
 
@@ -3570,6 +7588,7 @@ void prl_perf_benchmark(timing_callback bench_func, timing_callback init_callbac
 }
 
 void prl_mem_free(prl_mem mem) {
+    mem_wait_pending(mem);
     mem_free(NOSCOPINST, mem);
 }
 
@@ -3623,6 +7642,7 @@ void prl_free(void *ptr) {
     assert(mem);
     assert(is_valid_loc(mem));
 
+    mem_wait_pending(mem);
     mem_free(NOSCOPINST, mem);
 }
 
@@ -3712,20 +7732,24 @@ void prl_mem_change_flags(prl_mem mem, enum prl_mem_flags add_flags, enum prl_me
 	assert((add_flags & remove_flags) == 0);
 
 	prl_init();
+    mem_wait_pending(mem);
 
     bool enable_read = remove_flags & prl_mem_host_noread;
     bool enable_write = remove_flags & prl_mem_host_nowrite;
     bool disable_read = add_flags & prl_mem_host_noread;
-    bool disable_write = add_flags & prl_mem_host_noread;
+    bool disable_write = add_flags & prl_mem_host_nowrite;
 
 	mem->host_readable = (mem->host_readable && !disable_read) || enable_read;
 	mem->host_writable = (mem->host_writable && !disable_write) || enable_write;
 
     if (mem->host_readable || mem->host_writable) {
         ensure_host_allocated(NOSCOPINST, mem);
+        if (mem->host_lazy)
+            host_unprotect(mem); // Read back below if still needed
 
+        bool both_current = (mem->loc == loc_shared);
         if (mem->host_readable) {
-            if (mem->loc & loc_bit_dev_is_current) {
+            if (mem->loc == loc_dev) {
                 //TODO: Refactor into more general function
 				cl_command_queue queue ;
 				if (global_state.queue)
@@ -3734,16 +7758,21 @@ void prl_mem_change_flags(prl_mem mem, enum prl_mem_flags add_flags, enum prl_me
 					queue = clCreateCommandQueue_checked(NOSCOPINST, global_state.context, global_state.device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
 				assert(queue);
                 // cl_event event;
+                dirty_invalidate(mem);
                 clEnqueueReadBuffer_checked(NOSCOPINST, queue, mem->clmem, CL_BLOCKING_TRUE, 0, mem->size, mem->host_mem, 0, NULL, NULL);
+                count_transfer(NOSCOPINST, mem, dir_to_host, mem->size);
                 //TODO: push_back_event(NOSCOPINST, event, mem, NULL, false);
                 clFinish_checked(NOSCOPINST, queue);
 				mem_event_finished(NOSCOPINST, mem);
+                dirty_rebase(mem);
+                both_current = true;
 				if (queue != global_state.queue)
 					clReleaseCommandQueue_checked(NOSCOPINST, queue);
             }
         }
 
-        mem->loc = loc_host;
+        // Keep the device copy if the host cannot change the buffer behind our back
+        mem->loc = (both_current && mem->type == alloc_type_rwbuf) ? loc_after_readback(mem) : loc_host;
     }
 
     assert(is_valid_loc(mem));
@@ -3788,12 +7817,16 @@ void prl_mem_remove_flags(prl_mem mem, enum prl_mem_flags remove_flags) {
 }
 
 void prl_mem_kill(prl_mem mem) {
+    mem_wait_pending(mem);
     // Set nothing is current; implementation will establish a fresh new buffer without transfer
     mem->loc &= ~(loc_bit_host_is_current | loc_bit_dev_is_current);
+    if (mem->host_lazy)
+        host_unprotect(mem);
 }
 
 void prl_mem_fill(prl_mem mem, char fillchar) {
     assert(mem);
+    mem_wait_pending(mem);
 
     //TODO: Use clEnqueueFillBuffer (OpenCL 1.2) with clEnqueueNDRangeKernel fallback for dev side; at the moment we just rely on the data being transfered when used.
     ensure_host_allocated(NOSCOPINST, mem);
@@ -3804,6 +7837,9 @@ void prl_mem_fill(prl_mem mem, char fillchar) {
 		mem_event_finished(NOSCOPINST, mem);
 	}
 
+    dirty_invalidate(mem);
+    if (mem->host_lazy)
+        host_unprotect(mem); // Overwritten completely
     memset(mem->host_mem, fillchar, mem->size);
     mem->loc |= loc_bit_host_is_current;
     mem->loc &= ~loc_bit_dev_is_current;